@@ -35,6 +35,15 @@ void kbd_put_keycode(int keycode);
 void kbd_mouse_event(int dx, int dy, int dz, int buttons_state);
 int kbd_mouse_is_absolute(void);
 
+/* input-replay.c */
+typedef void QEMUInputGPIOEvent(void *opaque, int line, int level);
+
+void qemu_add_gpio_event_handler(QEMUInputGPIOEvent *func, void *opaque);
+int input_replay_open(const char *filename);
+int input_record_open(const char *filename);
+void input_record_key(int keycode);
+void input_record_mouse(int dx, int dy, int dz, int buttons_state);
+
 struct MouseTransformInfo {
     /* Touchscreen resolution */
     int x;
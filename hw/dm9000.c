@@ -14,6 +14,7 @@
 #include "hw/irq.h"
 #include "hw.h"
 #include "net.h"
+#include "qemu-timer.h"
 #include "dm9000.h"
 
 /* Comment this out if you don't want register debug on stderr */
@@ -164,13 +165,32 @@ enum {
 #define DM9K_CLIP_TX_INDEX(_v) 		((_v) & 1 ? DM9K_WRAP_TX_INDEX((_v)+1) : (_v))
 #define DM9K_CLIP_RX_INDEX(_v) 		((_v) & 1 ? DM9K_WRAP_RX_INDEX((_v)+1) : (_v))
 
+/*
+ * Both FIFOs are rings inside packet_buffer; anything that moves more than
+ * a word at a time goes through the helpers below, which split the access
+ * in (at most) two segments at the wrap point.
+ */
 typedef struct {
+    uint16_t start, end;
+} dm9k_ring;
+
+static const dm9k_ring dm9k_tx_ring = { DM9K_TX_FIFO_START, DM9K_TX_FIFO_SIZE };
+static const dm9k_ring dm9k_rx_ring = { DM9K_RX_FIFO_START, DM9K_FIFO_SIZE };
+
+#define DM9K_MCAST_CACHE	16
+#define DM9K_TX_RETRY_NS	100000
+
+struct dm9000_state_s {
     uint32_t addr; /* address port */
     uint32_t data; /* data port */
     VLANClientState *vc;
     qemu_irq irq;
     uint8_t macaddr[6];		/* MAC address -- default to qemu, can/will be overridden by guest driver */
     uint8_t mult[8];		/* multicast filtering fields */
+    struct dm9k_mcast_entry_s {
+        uint8_t mac[6];
+        uint8_t valid, accept;
+    } mcast_cache[DM9K_MCAST_CACHE];	/* hash filter decisions */
 
     uint8_t address; /* The internal magical register address */
 
@@ -190,8 +210,17 @@ typedef struct {
     uint16_t dm9k_mrr;
     uint16_t dm9k_mwr; /* Read and write address registers */
     uint16_t dm9k_txpl; /* TX packet length */
+    struct {
+        uint16_t start, len;
+    } tx_slot[2]; /* Packets queued by TXREQ, oldest first */
+    int tx_count;
+    QEMUBH *tx_bh;
+    QEMUTimer *tx_retry;
 
     uint8_t dm9k_imr, dm9k_isr; /* Interrupt mask register and status register*/
+    uint8_t isr_pending; /* ISR bits held back by interrupt coalescing */
+    int64_t coalesce_ns; /* Coalescing window, 0 if off */
+    QEMUTimer *coalesce_timer;
     uint8_t dm9k_ncr, dm9k_nsr; /* Network control register, network status register */
     uint8_t dm9k_rcr; /* RX Control Register */
     uint8_t dm9k_rsr; /* RX Status Register */
@@ -209,7 +238,63 @@ typedef struct {
     uint16_t dm9k_mii_anar;
     uint16_t dm9k_mii_dscr;
 
-} dm9000_state;
+};
+
+/*
+ * The hash is the top 6 bits of the big-endian Ethernet CRC, which is
+ * the bit-reversed low 6 bits of the (table-driven) little-endian one.
+ */
+static uint32_t dm9k_crc_table[256];
+
+static void dm9k_crc_init(void)
+{
+    uint32_t c;
+    int i, j;
+
+    if (dm9k_crc_table[1])
+        return;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = (c >> 1) ^ ((c & 1) ? 0xedb88320 : 0);
+        dm9k_crc_table[i] = c;
+    }
+}
+
+static int compute_mcast_idx(const uint8_t *ep)
+{
+    uint32_t crc = 0xffffffff;
+    int i, idx = 0;
+
+    for (i = 0; i < 6; i++)
+        crc = (crc >> 8) ^ dm9k_crc_table[(crc ^ ep[i]) & 0xff];
+    for (i = 0; i < 6; i++)
+        if (crc & (1 << i))
+            idx |= 0x20 >> i;
+    return idx;
+}
+
+/* Hash filter decision for a multicast destination, cached per address */
+static int dm9000_mcast_accept(dm9000_state *s, const uint8_t *mac)
+{
+    struct dm9k_mcast_entry_s *e =
+            &s->mcast_cache[(mac[4] ^ mac[5]) & (DM9K_MCAST_CACHE - 1)];
+    unsigned int mcast_idx;
+
+    if (e->valid && !memcmp(e->mac, mac, 6))
+        return e->accept;
+
+    mcast_idx = compute_mcast_idx(mac);
+    memcpy(e->mac, mac, 6);
+    e->accept = (s->mult[mcast_idx >> 3] >> (mcast_idx & 7)) & 1;
+    e->valid = 1;
+    return e->accept;
+}
+
+static void dm9000_mcast_flush(dm9000_state *s)
+{
+    memset(s->mcast_cache, 0, sizeof(s->mcast_cache));
+}
 
 static void dm9000_save(QEMUFile *f, void *opaque)
 {
@@ -245,6 +330,13 @@ static void dm9000_save(QEMUFile *f, void *opaque)
     qemu_put_be16s(f, &s->dm9k_mii_bmcr);
     qemu_put_be16s(f, &s->dm9k_mii_anar);
     qemu_put_be16s(f, &s->dm9k_mii_dscr);
+    qemu_put_8s(f, &s->isr_pending);
+    qemu_put_timer(f, s->coalesce_timer);
+    qemu_put_be32(f, s->tx_count);
+    qemu_put_be16s(f, &s->tx_slot[0].start);
+    qemu_put_be16s(f, &s->tx_slot[0].len);
+    qemu_put_be16s(f, &s->tx_slot[1].start);
+    qemu_put_be16s(f, &s->tx_slot[1].len);
 }
 
 static int dm9000_load(QEMUFile *f, void *opaque, int version_id)
@@ -280,6 +372,29 @@ static int dm9000_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_be16s(f, &s->dm9k_mii_bmcr);
     qemu_get_be16s(f, &s->dm9k_mii_anar);
     qemu_get_be16s(f, &s->dm9k_mii_dscr);
+    if (version_id >= 1) {
+        qemu_get_8s(f, &s->isr_pending);
+        qemu_get_timer(f, s->coalesce_timer);
+    }
+    s->tx_count = 0;
+    if (version_id >= 2) {
+        s->tx_count = qemu_get_be32(f);
+        qemu_get_be16s(f, &s->tx_slot[0].start);
+        qemu_get_be16s(f, &s->tx_slot[0].len);
+        qemu_get_be16s(f, &s->tx_slot[1].start);
+        qemu_get_be16s(f, &s->tx_slot[1].len);
+        if (s->tx_count < 0 || s->tx_count > 2 ||
+                        s->tx_slot[0].start >= DM9K_TX_FIFO_SIZE ||
+                        s->tx_slot[0].len > DM9K_TX_FIFO_SIZE ||
+                        s->tx_slot[1].start >= DM9K_TX_FIFO_SIZE ||
+                        s->tx_slot[1].len > DM9K_TX_FIFO_SIZE) {
+            s->tx_count = 0;
+            return -EINVAL;
+        }
+        if (s->tx_count)
+            qemu_bh_schedule(s->tx_bh);
+    }
+    dm9000_mcast_flush(s);
     return 0;
 }
 
@@ -320,6 +435,38 @@ static void dm9000_raise_irq(dm9000_state *s)
     qemu_set_irq(s->irq, level);
 }
 
+/*
+ * With coalescing on, the first RX/TX event latches its ISR bit straight
+ * away and opens a window; further events during the window are only
+ * latched, with a single interrupt, when it closes.  ISR bits keep their
+ * usual meaning, they are just set later.
+ */
+static void dm9000_coalesce_tick(void *opaque)
+{
+    dm9000_state *s = (dm9000_state *)opaque;
+
+    if (!s->isr_pending)
+        return;
+    s->dm9k_isr |= s->isr_pending;
+    s->isr_pending = 0;
+    dm9000_raise_irq(s);
+    qemu_mod_timer(s->coalesce_timer,
+                    qemu_get_clock(vm_clock) + s->coalesce_ns);
+}
+
+static void dm9000_isr_latch(dm9000_state *s, uint8_t bits)
+{
+    if (s->coalesce_ns && qemu_timer_pending(s->coalesce_timer)) {
+        s->isr_pending |= bits;
+        return;
+    }
+    s->dm9k_isr |= bits;
+    dm9000_raise_irq(s);
+    if (s->coalesce_ns)
+        qemu_mod_timer(s->coalesce_timer,
+                        qemu_get_clock(vm_clock) + s->coalesce_ns);
+}
+
 static void dm9000_soft_reset_mii(dm9000_state *s)
 {
     s->dm9k_mii_bmcr = 0x3100; /* 100Mbps, AUTONEG, FULL DUPLEX */
@@ -345,6 +492,10 @@ static void dm9000_soft_reset(dm9000_state *s)
     s->fc_low_mark = 8 * 1024;
 
     s->packet_index = 0;
+    s->isr_pending = 0;
+    qemu_del_timer(s->coalesce_timer);
+    s->tx_count = 0;
+    qemu_del_timer(s->tx_retry);
     memset(s->packet_buffer, 0, sizeof(s->packet_buffer));
     memset(s->packet_copy_buffer, 0, sizeof(s->packet_copy_buffer));
     /* These registers have some bits "unaffected by software reset" */
@@ -372,6 +523,60 @@ static void dm9000_hard_reset(dm9000_state *s)
     dm9000_soft_reset(s);
 }
 
+/* Points IOV at the LEN bytes at IDX in the ring, returns the segment count */
+static int dm9k_ring_iov(dm9000_state *s, const dm9k_ring *r, uint16_t idx,
+		int len, struct iovec *iov)
+{
+	int p1 = r->end - idx;
+
+	iov[0].iov_base = s->packet_buffer + idx;
+	if (len <= p1) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+	iov[0].iov_len = p1;
+	iov[1].iov_base = s->packet_buffer + r->start;
+	iov[1].iov_len = len - p1;
+	return 2;
+}
+
+static inline uint16_t dm9k_ring_advance(const dm9k_ring *r,
+		uint16_t idx, int len)
+{
+	idx += len;
+	return idx >= r->end ? idx - (r->end - r->start) : idx;
+}
+
+/* Copies BUF (or zeroes if BUF is NULL) into the ring, returns the new index */
+static uint16_t dm9k_ring_write(dm9000_state *s, const dm9k_ring *r,
+		uint16_t idx, const uint8_t *buf, int len)
+{
+	struct iovec iov[2];
+	int i, n = dm9k_ring_iov(s, r, idx, len, iov);
+
+	for (i = 0; i < n; i++) {
+		if (buf) {
+			memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+			buf += iov[i].iov_len;
+		} else
+			memset(iov[i].iov_base, 0, iov[i].iov_len);
+	}
+	return dm9k_ring_advance(r, idx, len);
+}
+
+static uint16_t dm9k_ring_read(dm9000_state *s, const dm9k_ring *r,
+		uint16_t idx, uint8_t *buf, int len)
+{
+	struct iovec iov[2];
+	int i, n = dm9k_ring_iov(s, r, idx, len, iov);
+
+	for (i = 0; i < n; i++) {
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+	return dm9k_ring_advance(r, idx, len);
+}
+
 static uint16_t dm9000_get_rx_fifo_fill_state(dm9000_state *s)
 {
 	uint16_t res;
@@ -382,46 +587,91 @@ static uint16_t dm9000_get_rx_fifo_fill_state(dm9000_state *s)
 	return res;
 }
 
-static void dm9000_do_transmit(dm9000_state *s) {
-	uint16_t idx, cnt, tptr;
-	idx = s->dm9k_trpa;
-
-	cnt = s->dm9k_txpl;
-	if (cnt > DM9K_TX_FIFO_SIZE)
-		cnt = DM9K_TX_FIFO_SIZE; /* HARD CAP AT 3KiB */
+/* Sends the frame in the oldest TX slot, straight from the FIFO */
+static void dm9000_tx_send(dm9000_state *s)
+{
+	struct iovec iov[2];
+	uint16_t cnt = s->tx_slot[0].len;
+	int n;
 
-	tptr = 0;
-	while (cnt--) {
-		s->packet_copy_buffer[tptr++] = s->packet_buffer[idx];
-		idx = DM9K_WRAP_TX_INDEX(idx+1);
-	}
+	n = dm9k_ring_iov(s, &dm9k_tx_ring, s->tx_slot[0].start, cnt, iov);
 
 #ifdef DM9000_DEBUG
 	{
-		uint8_t *buf = &s->packet_copy_buffer[6];
-		DM9000_DBF("TX_Packet: %02x:%02x:%02x:%02x:%02x:%02x %d bytes from %04x\n",
+		uint8_t *buf = (uint8_t *) iov[0].iov_base;
+		DM9000_DBF("TX_Packet: %02x:%02x:%02x:%02x:%02x:%02x %d bytes from %04x in %d segments\n",
 				buf[0],buf[1],buf[2],buf[3],buf[4],buf[5],
-				tptr, idx);
-//		hexdump(s->packet_copy_buffer, tptr);
+				cnt, s->tx_slot[0].start, n);
 	}
 #endif
+#ifdef DM9000_DUMP_FILENAME
+	memcpy(s->packet_copy_buffer, iov[0].iov_base, iov[0].iov_len);
+	if (n > 1)
+		memcpy(s->packet_copy_buffer + iov[0].iov_len,
+				iov[1].iov_base, iov[1].iov_len);
+	dm9k_dump_packet(s->packet_copy_buffer, cnt);
+#endif
 
-	s->dm9k_trpa = DM9K_CLIP_TX_INDEX(idx);
-	dm9k_dump_packet(s->packet_copy_buffer, s->dm9k_txpl);
-	/* We have the copy buffer, now we do the transmit */
-	qemu_send_packet(s->vc, s->packet_copy_buffer, s->dm9k_txpl);
+	qemu_sendv_packet(s->vc, iov, n);
+	s->dm9k_trpa = DM9K_CLIP_TX_INDEX(
+			dm9k_ring_advance(&dm9k_tx_ring, s->tx_slot[0].start, cnt));
 
-	/* Clear the "please xmit" bit */
-	s->dm9k_tcr &= ~DM9000_TCR_TXREQ;
+	s->tx_slot[0] = s->tx_slot[1];
+	if (!--s->tx_count)
+		/* Clear the "please xmit" bit */
+		s->dm9k_tcr &= ~DM9000_TCR_TXREQ;
 	/* Set the TXEND bit */
 	s->dm9k_nsr |= 1 << (2 + s->packet_index);
 	DM9000_DBF("TX: NSR=%02x PI=%d\n", s->dm9k_nsr, s->packet_index);
-	/* Claim a TX complete IRQ */
-	s->dm9k_isr |= DM9000_ISR_PTS; /* Packet transmitted latch */
 	/* And flip the next-packet bit */
 	s->packet_index++;
 
-	dm9000_raise_irq(s);
+	/* Claim a TX complete IRQ */
+	dm9000_isr_latch(s, DM9000_ISR_PTS); /* Packet transmitted latch */
+}
+
+/*
+ * Frames queued by TXREQ go out from a bottom half, so the guest can
+ * fill the other half of the TX SRAM meanwhile.  If the VLAN can't take
+ * a frame now, the send is retried a little later.
+ */
+static void dm9000_tx_bh(void *opaque)
+{
+	dm9000_state *s = (dm9000_state *)opaque;
+
+	while (s->tx_count) {
+		if (!qemu_can_send_packet(s->vc)) {
+			qemu_mod_timer(s->tx_retry, qemu_get_clock(vm_clock) +
+					DM9K_TX_RETRY_NS);
+			return;
+		}
+		dm9000_tx_send(s);
+	}
+}
+
+static void dm9000_tx_request(dm9000_state *s)
+{
+	uint16_t cnt;
+
+	if (s->tx_count >= 2) {
+		DM9000_DBF("TX: both packet slots busy, TXREQ ignored\n");
+		return;
+	}
+
+	cnt = s->dm9k_txpl;
+	if (cnt > DM9K_TX_FIFO_SIZE)
+		cnt = DM9K_TX_FIFO_SIZE; /* HARD CAP AT 3KiB */
+
+	/* The second packet follows the first one in the SRAM */
+	if (s->tx_count)
+		s->tx_slot[1].start = DM9K_CLIP_TX_INDEX(dm9k_ring_advance(
+				&dm9k_tx_ring, s->tx_slot[0].start, s->tx_slot[0].len));
+	else
+		s->tx_slot[0].start = s->dm9k_trpa;
+	s->tx_slot[s->tx_count++].len = cnt;
+	s->dm9k_tcr |= DM9000_TCR_TXREQ;
+
+	qemu_bh_schedule(s->tx_bh);
 }
 
 static void dm9000_mii_read(dm9000_state *s)
@@ -487,21 +737,12 @@ static void dm9000_mii_write(dm9000_state *s)
     }
 }
 
-static void dm9000_write(void *opaque, target_phys_addr_t address,
-                             uint32_t value)
+static void dm9000_reg_write(dm9000_state *s, uint32_t value)
 {
-    dm9000_state *s = (dm9000_state *)opaque;
 #ifdef DM9000_DEBUG
     int suppress_debug = 0;
 #endif
 
-    if (address == s->addr) {
-    //    if( (value != DM9000_REG_MRCMD) && (value != DM9000_REG_MWCMD) )
-    //        DM9000_DBF("DM9000: Address set to 0x%02x\n", value);
-        s->address = value;
-        return;
-    }
-
     switch(s->address) {
     case DM9000_REG_NCR:
         DM9000_DBF("DM9000_REG_NCR: %02x=%04x\n", s->address, value);
@@ -513,9 +754,11 @@ static void dm9000_write(void *opaque, target_phys_addr_t address,
         s->dm9k_nsr &= ~(value & ~DM9000_NSR_READONLY);
         break;
     case DM9000_REG_TCR:
-        s->dm9k_tcr = value & 0xFF;
+        s->dm9k_tcr = (value & 0xFF) & ~DM9000_TCR_TXREQ;
+        if (s->tx_count)
+        	s->dm9k_tcr |= DM9000_TCR_TXREQ;
         if ( value & DM9000_TCR_TXREQ )
-        	dm9000_do_transmit(s);
+        	dm9000_tx_request(s);
         break;
     case DM9000_REG_EPCR:
         s->dm9k_epcr = value & 0xFF;
@@ -526,6 +769,7 @@ static void dm9000_write(void *opaque, target_phys_addr_t address,
         break;
     case DM9000_REG_RCR:
     	s->dm9k_rcr = value & 0xFF;
+    	dm9000_mcast_flush(s);
         break;
 
     case DM9000_REG_BPTR: /* can be ignored */
@@ -559,6 +803,7 @@ static void dm9000_write(void *opaque, target_phys_addr_t address,
     case DM9000_REG_MAR0 ... DM9000_REG_MAR7:
 		/* Multicast address is ignored */
 		s->mult[s->address - DM9000_REG_MAR0] = value;
+		dm9000_mcast_flush(s);
 		break;
     case DM9000_REG_GPCR:
     case DM9000_REG_GPR:	/* General purpose reg (GPIOs, LED?) */
@@ -624,16 +869,27 @@ static void dm9000_write(void *opaque, target_phys_addr_t address,
 #endif
 }
 
-static uint32_t dm9000_read(void *opaque, target_phys_addr_t address)
+static void dm9000_write(void *opaque, target_phys_addr_t address,
+                             uint32_t value)
 {
     dm9000_state *s = (dm9000_state *)opaque;
+
+    if (address == s->addr) {
+    //    if( (value != DM9000_REG_MRCMD) && (value != DM9000_REG_MWCMD) )
+    //        DM9000_DBF("DM9000: Address set to 0x%02x\n", value);
+        s->address = value;
+        return;
+    }
+    dm9000_reg_write(s, value);
+}
+
+static uint32_t dm9000_reg_read(dm9000_state *s)
+{
     uint32_t ret = 0;
 #ifdef DM9000_DEBUG
     int suppress_debug = 0;
 #endif
 
-    if (address == s->addr)
-        return s->address;
     switch(s->address) {
     case DM9000_REG_NCR:
         ret = s->dm9k_ncr;
@@ -757,6 +1013,94 @@ static uint32_t dm9000_read(void *opaque, target_phys_addr_t address)
     return ret;
 }
 
+static uint32_t dm9000_read(void *opaque, target_phys_addr_t address)
+{
+    dm9000_state *s = (dm9000_state *)opaque;
+
+    if (address == s->addr)
+        return s->address;
+    return dm9000_reg_read(s);
+}
+
+/*
+ * The data port has its own io slot.  Moving packet data through MRCMD
+ * and MWCMD with the FIFO pointers auto-wrapping is by far the most
+ * common access, it is served before looking at the register index.
+ */
+static uint32_t dm9000_data_read(void *opaque, target_phys_addr_t address)
+{
+    dm9000_state *s = (dm9000_state *)opaque;
+    uint32_t ret;
+
+    if (s->address == DM9000_REG_MRCMD &&
+                    (s->dm9k_imr & DM9000_IMR_AUTOWRAP) &&
+                    s->dm9k_mrr != s->dm9k_rwpa) {
+        /* DM9KNOTE: This assumes a 16bit wide wiring */
+        ret = s->packet_buffer[s->dm9k_mrr];
+        ret |= s->packet_buffer[s->dm9k_mrr + 1] << 8;
+        s->dm9k_mrr = DM9K_WRAP_RX_INDEX(s->dm9k_mrr + 2);
+        return ret;
+    }
+    return dm9000_reg_read(s);
+}
+
+static void dm9000_data_write(void *opaque, target_phys_addr_t address,
+                uint32_t value)
+{
+    dm9000_state *s = (dm9000_state *)opaque;
+
+    if (s->address == DM9000_REG_MWCMD &&
+                    (s->dm9k_imr & DM9000_IMR_AUTOWRAP)) {
+        s->packet_buffer[s->dm9k_mwr] = value & 0xFF;
+        s->packet_buffer[s->dm9k_mwr + 1] = (value >> 8) & 0xFF;
+        s->dm9k_mwr = DM9K_WRAP_TX_INDEX(s->dm9k_mwr + 2);
+        return;
+    }
+    dm9000_reg_write(s, value);
+}
+
+/*
+ * Reads LEN bytes of RX data through MRCMD in one go, for DMA engines
+ * that drain frames from the data port.  Returns LEN, or 0 if the data
+ * is not all there or the port is not set up for a plain auto-wrapping
+ * stream, in which case the caller goes through the port word by word.
+ */
+int dm9000_read_block(dm9000_state *s, uint8_t *buf, int len)
+{
+    int avail;
+
+    if (s->address != DM9000_REG_MRCMD ||
+                    !(s->dm9k_imr & DM9000_IMR_AUTOWRAP) ||
+                    (len & 1) || (s->dm9k_mrr & 1) ||
+                    s->dm9k_mrr < DM9K_RX_FIFO_START ||
+                    s->dm9k_mrr >= DM9K_FIFO_SIZE)
+        return 0;
+
+    if (s->dm9k_rwpa >= s->dm9k_mrr)
+        avail = s->dm9k_rwpa - s->dm9k_mrr;
+    else
+        avail = DM9K_RX_FIFO_SIZE - (s->dm9k_mrr - s->dm9k_rwpa);
+    if (len > avail)
+        return 0;
+
+    s->dm9k_mrr = dm9k_ring_read(s, &dm9k_rx_ring, s->dm9k_mrr, buf, len);
+    return len;
+}
+
+/* Same for TX data written through MWCMD */
+int dm9000_write_block(dm9000_state *s, const uint8_t *buf, int len)
+{
+    if (s->address != DM9000_REG_MWCMD ||
+                    !(s->dm9k_imr & DM9000_IMR_AUTOWRAP) ||
+                    (len & 1) || (s->dm9k_mwr & 1) ||
+                    s->dm9k_mwr >= DM9K_TX_FIFO_SIZE ||
+                    len > DM9K_TX_FIFO_SIZE)
+        return 0;
+
+    s->dm9k_mwr = dm9k_ring_write(s, &dm9k_tx_ring, s->dm9k_mwr, buf, len);
+    return len;
+}
+
 
 static int dm9000_can_receive(void *opaque)
 {
@@ -767,35 +1111,11 @@ static int dm9000_can_receive(void *opaque)
     return rx_space > 1522;
 }
 
-#define POLYNOMINAL 0x04c11db6
-
-/* From FreeBSD */
-/* XXX: optimize */
-static int compute_mcast_idx(const uint8_t *ep)
-{
-    uint32_t crc;
-    int carry, i, j;
-    uint8_t b;
-
-    crc = 0xffffffff;
-    for (i = 0; i < 6; i++) {
-        b = *ep++;
-        for (j = 0; j < 8; j++) {
-            carry = ((crc & 0x80000000L) ? 1 : 0) ^ (b & 0x01);
-            crc <<= 1;
-            b >>= 1;
-            if (carry)
-                crc = ((crc ^ POLYNOMINAL) | carry);
-        }
-    }
-    return (crc >> 26);
-}
-
 static void dm9000_receive(void *opaque, const uint8_t *buf, int size)
 {
     dm9000_state *s = (dm9000_state *)opaque;
     uint16_t rxptr = s->dm9k_rwpa;
-    unsigned int mcast_idx = 0;
+    uint8_t hdr[4];
     int pad = 4;
 
     if (!(s->dm9k_rcr & DM9000_RCR_RXEN))
@@ -806,8 +1126,7 @@ static void dm9000_receive(void *opaque, const uint8_t *buf, int size)
     	if (buf[0] & 0x01) {
             /* multi/broadcast */
             if (!(s->dm9k_rcr & DM9000_RCR_ALL)) {
-            	mcast_idx = compute_mcast_idx(buf);
-            	if (!(s->mult[mcast_idx >> 3] & (1 << (mcast_idx & 7))))
+            	if (!dm9000_mcast_accept(s, buf))
             		return;
                 s->dm9k_rsr |= DM9000_RSR_MF;
             }
@@ -837,38 +1156,22 @@ static void dm9000_receive(void *opaque, const uint8_t *buf, int size)
     if (size < 64)
     	pad = 64 - size;
 
+    hdr[0] = 0x01; /* Packet read */
+    hdr[1] = 0x00; /* Status OK */
+    hdr[2] = (size+pad) & 0xFF; /* Size LOW */
+    hdr[3] = ((size+pad) >> 8) & 0xff; /* Size HIGH */
+
     rxptr = DM9K_CLIP_RX_INDEX(rxptr);
-    /* store header */
-    s->packet_buffer[rxptr] = 0x01; /* Packet read */
-    rxptr = DM9K_WRAP_RX_INDEX(rxptr+1);
-    s->packet_buffer[rxptr] = 0x00; /* Status OK */
-    rxptr = DM9K_WRAP_RX_INDEX(rxptr+1);
-    s->packet_buffer[rxptr] = (size+pad) & 0xFF; /* Size LOW */
-    rxptr = DM9K_WRAP_RX_INDEX(rxptr+1);
-    s->packet_buffer[rxptr] = ((size+pad) >> 8) & 0xff; /* Size HIGH */
-    rxptr = DM9K_WRAP_RX_INDEX(rxptr+1);
-
-    if (DM9K_FIFO_SIZE - rxptr > size) {
-    	memcpy(s->packet_buffer + rxptr, buf, size);
-		rxptr += size;
-    } else {
-    	int p1 = DM9K_FIFO_SIZE - rxptr;
-    	memcpy(s->packet_buffer + rxptr, buf, p1);
-    	buf += p1;
-		rxptr = DM9K_RX_FIFO_START;	/* wrap */
-		p1 = size - p1;	/* remaining */
-    	memcpy(s->packet_buffer + rxptr, buf, p1);
-		rxptr += p1;
-    }
+    rxptr = dm9k_ring_write(s, &dm9k_rx_ring, rxptr, hdr, sizeof(hdr));
+    rxptr = dm9k_ring_write(s, &dm9k_rx_ring, rxptr, buf, size);
     /* obligatory padding */
-    while (pad--) {
-		s->packet_buffer[rxptr] = 0;
-		rxptr = DM9K_WRAP_RX_INDEX(rxptr+1);
-    }
+    rxptr = dm9k_ring_write(s, &dm9k_rx_ring, rxptr, NULL, pad);
 
     s->dm9k_rwpa = DM9K_CLIP_RX_INDEX(rxptr);
-    s->dm9k_isr |= DM9000_ISR_PRS; /* RX interrupt, yay */
-    dm9000_raise_irq(s);
+    dm9000_isr_latch(s, DM9000_ISR_PRS); /* RX interrupt, yay */
+    /* End the batch early if the guest has to make room for the next one */
+    if (s->isr_pending && !dm9000_can_receive(s))
+        dm9000_coalesce_tick(s);
 }
 
 
@@ -884,6 +1187,18 @@ static CPUWriteMemoryFunc *dm9000_writefn[] = {
     dm9000_write
 };
 
+static CPUReadMemoryFunc *dm9000_data_readfn[] = {
+    dm9000_data_read,
+    dm9000_data_read,
+    dm9000_data_read
+};
+
+static CPUWriteMemoryFunc *dm9000_data_writefn[] = {
+    dm9000_data_write,
+    dm9000_data_write,
+    dm9000_data_write
+};
+
 static void dm9000_cleanup(VLANClientState *vc)
 {
     /* dm9000_state *s = (dm9000_state *)vc->opaque; */
@@ -893,7 +1208,7 @@ static void dm9000_cleanup(VLANClientState *vc)
  * The dm9k has a single 16bit wide address and data port through which all
  *  operations are multiplexed, there is a single IRQ
  */
-void dm9000_init(NICInfo *nd, target_phys_addr_t base_addr,
+dm9000_state *dm9000_init(NICInfo *nd, target_phys_addr_t base_addr,
                  uint32_t addr_offset, uint32_t data_offset,
                  qemu_irq irq)
 {
@@ -904,11 +1219,15 @@ void dm9000_init(NICInfo *nd, target_phys_addr_t base_addr,
     iomemtype = cpu_register_io_memory(0, dm9000_readfn,
                                        dm9000_writefn, s);
     cpu_register_physical_memory(base_addr, MAX(addr_offset, data_offset) + 4, iomemtype);
+    iomemtype = cpu_register_io_memory(0, dm9000_data_readfn,
+                                       dm9000_data_writefn, s);
+    cpu_register_physical_memory(base_addr + data_offset, 4, iomemtype);
     s->addr = addr_offset;
     s->data = data_offset;
     s->irq = irq;
     memcpy(s->macaddr, nd->macaddr, 6);
     memset(s->mult, 0xff, 8);
+    dm9k_crc_init();
 
     {
 		uint8_t * buf = s->macaddr;
@@ -916,7 +1235,14 @@ void dm9000_init(NICInfo *nd, target_phys_addr_t base_addr,
     		buf[0],buf[1],buf[2],buf[3],buf[4],buf[5]);
     }
 
-    register_savevm("dm9000", 0, 0, dm9000_save, dm9000_load, s);
+    s->coalesce_ns = (int64_t) nd->coalesce * 1000;
+    s->coalesce_timer = qemu_new_timer(vm_clock, dm9000_coalesce_tick, s);
+    s->tx_bh = qemu_bh_new(dm9000_tx_bh, s);
+    s->tx_retry = qemu_new_timer(vm_clock, dm9000_tx_bh, s);
+    if (s->coalesce_ns)
+        printf("DM9000: coalescing interrupts over %d us\n", nd->coalesce);
+
+    register_savevm("dm9000", 0, 2, dm9000_save, dm9000_load, s);
 
     dm9000_hard_reset(s);
 
@@ -925,4 +1251,5 @@ void dm9000_init(NICInfo *nd, target_phys_addr_t base_addr,
 			dm9000_cleanup, s);
     qemu_format_nic_info_str(s->vc, s->macaddr);
 
+    return s;
 }
@@ -12,7 +12,11 @@
 #ifndef QEMU_HW_DM9000_H
 #define QEMU_HW_DM9000_H
 
-void dm9000_init(NICInfo *nd, target_phys_addr_t base_addr, uint32_t addr_offset,
+typedef struct dm9000_state_s dm9000_state;
+
+dm9000_state *dm9000_init(NICInfo *nd, target_phys_addr_t base_addr, uint32_t addr_offset,
                  uint32_t data_offset, qemu_irq irq);
+int dm9000_read_block(dm9000_state *s, uint8_t *buf, int len);
+int dm9000_write_block(dm9000_state *s, const uint8_t *buf, int len);
 
 #endif
@@ -64,6 +64,51 @@ uint8_t ecc_digest(ECCState *s, uint8_t sample)
     return sample;
 }
 
+/*
+ * Same as LEN calls to ecc_digest, one 32-bit word at a time.  Column
+ * parity is linear so it is looked up once for the XOR of all bytes,
+ * and the line parity only needs the parity of each byte in the word.
+ */
+void ecc_digest_block(ECCState *s, const uint8_t *buf, int len)
+{
+    uint32_t w, p, acc = 0;
+    uint16_t lp = 0, count;
+    int odd = 0;
+
+    for (; len && (s->count & 3); len --)
+        ecc_digest(s, *buf ++);
+
+    for (count = s->count; len >= 4; len -= 4, buf += 4, count += 4) {
+        w = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+        acc ^= w;
+
+        /* Parity of each byte lands in bits 0, 8, 16 and 24 */
+        p = w ^ (w >> 4);
+        p ^= p >> 2;
+        p ^= p >> 1;
+        p &= 0x01010101;
+        if (!p)
+            continue;
+
+        if ((p ^ (p >> 8) ^ (p >> 16) ^ (p >> 24)) & 1) {
+            lp ^= count;
+            odd ^= 1;
+        }
+        lp ^= ((p >> 8) ^ (p >> 24)) & 1;
+        lp ^= (((p >> 16) ^ (p >> 24)) & 1) << 1;
+    }
+
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    s->cp ^= nand_ecc_precalc_table[acc & 0xff] & 0x3f;
+    s->lp[0] ^= odd ? ~lp : lp;
+    s->lp[1] ^= lp;
+    s->count = count;
+
+    while (len --)
+        ecc_digest(s, *buf ++);
+}
+
 /* Reinitialise the counters.  */
 void ecc_reset(ECCState *s)
 {
@@ -73,6 +118,128 @@ void ecc_reset(ECCState *s)
     s->count = 0;
 }
 
+/*
+ * Binary BCH code over GF(2^13), the 512-byte step codes used by Linux
+ * for 4 and 8 bit correction.  The parity is the remainder of the data
+ * polynomial times x^(13 * t) divided by the code generator, computed
+ * a byte at a time with a per-code table built on first use.
+ */
+#define BCH_M		13
+#define BCH_N		((1 << BCH_M) - 1)
+#define BCH_POLY	0x201b
+
+static uint32_t ecc_bch_tab[2][256][4];
+static int ecc_bch_ready[2];
+
+static void ecc_bch_build(int t, uint32_t tab[256][4])
+{
+    static uint16_t alog[BCH_N], log[BCH_N + 1];
+    static uint8_t seen[BCH_N];
+    uint8_t g[BCH_M * 8 + 1], ng[BCH_M * 8 + 1];
+    uint16_t mp[BCH_M + 1], a;
+    uint32_t gen[4], rem[4], fb;
+    int i, j, k, l, deg, mdeg, x, v;
+
+    for (i = 0, v = 1; i < BCH_N; i ++) {
+        alog[i] = v;
+        log[v] = i;
+        v <<= 1;
+        if (v & (1 << BCH_M))
+            v ^= BCH_POLY;
+    }
+
+    /* Multiply together the minimal polynomials of alpha^1 .. alpha^2t-1 */
+    memset(seen, 0, sizeof(seen));
+    memset(g, 0, sizeof(g));
+    g[0] = 1;
+    deg = 0;
+    for (i = 1; i < 2 * t; i += 2) {
+        if (seen[i])
+            continue;
+
+        memset(mp, 0, sizeof(mp));
+        mp[0] = 1;
+        mdeg = 0;
+        j = i;
+        do {
+            seen[j] = 1;
+            a = alog[j];
+            for (k = ++ mdeg; k > 0; k --)
+                mp[k] = mp[k - 1] ^ (mp[k] ?
+                                alog[(log[mp[k]] + log[a]) % BCH_N] : 0);
+            mp[0] = alog[(log[mp[0]] + log[a]) % BCH_N];
+            j = (j * 2) % BCH_N;
+        } while (j != i);
+
+        memset(ng, 0, sizeof(ng));
+        for (k = 0; k <= deg; k ++)
+            for (l = 0; l <= mdeg; l ++)
+                ng[k + l] ^= g[k] & mp[l];
+        deg += mdeg;
+        memcpy(g, ng, sizeof(g));
+    }
+
+    /* Generator minus its x^deg term, aligned to bit 127 */
+    memset(gen, 0, sizeof(gen));
+    for (k = 0; k < deg; k ++)
+        if (g[deg - 1 - k])
+            gen[k >> 5] |= 0x80000000 >> (k & 31);
+
+    for (x = 0; x < 256; x ++) {
+        memset(rem, 0, sizeof(rem));
+        for (i = 7; i >= 0; i --) {
+            fb = (rem[0] >> 31) ^ ((x >> i) & 1);
+            for (k = 0; k < 3; k ++)
+                rem[k] = (rem[k] << 1) | (rem[k + 1] >> 31);
+            rem[3] <<= 1;
+            if (fb)
+                for (k = 0; k < 4; k ++)
+                    rem[k] ^= gen[k];
+        }
+        memcpy(tab[x], rem, sizeof(rem));
+    }
+}
+
+/* T is the number of correctable bits, 4 or 8, or zero to disable.  */
+void ecc_bch_reset(ECCBCHState *s, int t)
+{
+    int i = (t == 8);
+
+    s->t = (t == 4 || t == 8) ? t : 0;
+    memset(s->rem, 0, sizeof(s->rem));
+    if (s->t && !ecc_bch_ready[i]) {
+        ecc_bch_build(s->t, ecc_bch_tab[i]);
+        ecc_bch_ready[i] = 1;
+    }
+}
+
+void ecc_bch_digest_block(ECCBCHState *s, const uint8_t *buf, int len)
+{
+    uint32_t (*tab)[4] = ecc_bch_tab[s->t == 8];
+    uint32_t *r = s->rem;
+    const uint32_t *e;
+
+    if (!s->t)
+        return;
+
+    while (len --) {
+        e = tab[(r[0] >> 24) ^ *buf ++];
+        r[0] = ((r[0] << 8) | (r[1] >> 24)) ^ e[0];
+        r[1] = ((r[1] << 8) | (r[2] >> 24)) ^ e[1];
+        r[2] = ((r[2] << 8) | (r[3] >> 24)) ^ e[2];
+        r[3] = (r[3] << 8) ^ e[3];
+    }
+}
+
+/* Parity bytes in on-flash order, (13 * t + 7) / 8 of them.  */
+void ecc_bch_code(ECCBCHState *s, uint8_t *code)
+{
+    int i;
+
+    for (i = 0; i < (BCH_M * s->t + 7) / 8; i ++)
+        code[i] = s->rem[i >> 2] >> (24 - ((i & 3) << 3));
+}
+
 /* Save/restore */
 void ecc_put(QEMUFile *f, ECCState *s)
 {
@@ -89,3 +256,21 @@ void ecc_get(QEMUFile *f, ECCState *s)
     qemu_get_be16s(f, &s->lp[1]);
     qemu_get_be16s(f, &s->count);
 }
+
+void ecc_bch_put(QEMUFile *f, ECCBCHState *s)
+{
+    int i;
+
+    qemu_put_be32(f, s->t);
+    for (i = 0; i < 4; i ++)
+        qemu_put_be32s(f, &s->rem[i]);
+}
+
+void ecc_bch_get(QEMUFile *f, ECCBCHState *s)
+{
+    int i;
+
+    ecc_bch_reset(s, qemu_get_be32(f));
+    for (i = 0; i < 4; i ++)
+        qemu_get_be32s(f, &s->rem[i]);
+}
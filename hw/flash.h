@@ -25,6 +25,8 @@ void nand_setpins(NANDFlashState *s,
 void nand_getpins(NANDFlashState *s, int *rb);
 void nand_setio(NANDFlashState *s, uint8_t value);
 uint8_t nand_getio(NANDFlashState *s);
+void nand_getio_block(NANDFlashState *s, uint8_t *buf, int len);
+void nand_setio_block(NANDFlashState *s, const uint8_t *buf, int len);
 uint32_t nand_readraw(NANDFlashState *s, uint32_t offset, void * dst, uint32_t length);
 
 #define NAND_MFR_TOSHIBA	0x98
@@ -50,6 +52,18 @@ typedef struct {
 } ECCState;
 
 uint8_t ecc_digest(ECCState *s, uint8_t sample);
+void ecc_digest_block(ECCState *s, const uint8_t *buf, int len);
 void ecc_reset(ECCState *s);
 void ecc_put(QEMUFile *f, ECCState *s);
 void ecc_get(QEMUFile *f, ECCState *s);
+
+typedef struct {
+    int t;		/* Correctable bits per step, 0 if disabled */
+    uint32_t rem[4];	/* Remainder, MSB aligned */
+} ECCBCHState;
+
+void ecc_bch_reset(ECCBCHState *s, int t);
+void ecc_bch_digest_block(ECCBCHState *s, const uint8_t *buf, int len);
+void ecc_bch_code(ECCBCHState *s, uint8_t *code);
+void ecc_bch_put(QEMUFile *f, ECCBCHState *s);
+void ecc_bch_get(QEMUFile *f, ECCBCHState *s);
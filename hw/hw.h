@@ -252,6 +252,10 @@ typedef void QEMUResetHandler(void *opaque);
 
 void qemu_register_reset(QEMUResetHandler *func, void *opaque);
 
+typedef void QEMURTCWarpHandler(void *opaque, int seconds);
+
+void qemu_register_rtc_warp(QEMURTCWarpHandler *func, void *opaque);
+
 /* handler to set the boot_device for a specific type of QEMUMachine */
 /* return 0 if success */
 typedef int QEMUBootSetHandler(void *opaque, const char *boot_device);
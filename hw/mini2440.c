@@ -35,6 +35,15 @@
 #define MINI2440_IRQ_nSD_DETECT		S3C_EINT(16)
 #define MINI2440_IRQ_DM9000			S3C_EINT(7)
 
+/* DM9000 on nGCS4, address and data ports at these offsets */
+#define MINI2440_DM9000_BASE		0x20000000
+#define MINI2440_DM9000_ADDR		0x300
+#define MINI2440_DM9000_DATA		0x304
+
+/* K1 to K6 user buttons, active low, all on port G */
+#define MINI2440_GPIO_BUTTONS		((1 << 0) | (1 << 3) | (1 << 5) | \
+					 (1 << 6) | (1 << 7) | (1 << 11))
+
 #define FLASH_NOR_SIZE (2*1024*1024)
 
 #define BOOT_NONE	0
@@ -51,6 +60,7 @@ struct mini2440_board_s {
     pflash_t * nor;
     int bl_level;
     int boot_mode;
+    uint32_t buttons;
 };
 
 /*
@@ -200,12 +210,42 @@ static void mini2440_bl_intensity(int line, int level, void *opaque)
     }
 }
 
+/* F1 to F6 press the K1 to K6 buttons */
+static void mini2440_key_event(void *opaque, int keycode)
+{
+    struct mini2440_board_s *s = (struct mini2440_board_s *) opaque;
+    static const int line[6] = { 0, 3, 5, 6, 7, 11 };
+    int key = (keycode & 0x7f) - 0x3b;
+
+    if (keycode == 0xe0 || key < 0 || key > 5)
+        return;
+
+    if (keycode & 0x80)
+        s->buttons &= ~(1 << line[key]);
+    else
+        s->buttons |= 1 << line[key];
+    s3c_gpio_set_mask(s->cpu->io, 6, MINI2440_GPIO_BUTTONS, ~s->buttons);
+}
+
+/* Input traces may drive any GPIO line, numbered as S3C_GP() */
+static void mini2440_gpio_event(void *opaque, int line, int level)
+{
+    struct mini2440_board_s *s = (struct mini2440_board_s *) opaque;
+
+    if (line >= 0 && line < S3C_GP_MAX)
+        qemu_set_irq(s3c_gpio_in_get(s->cpu->io)[line], level);
+}
+
 static void mini2440_gpio_setup(struct mini2440_board_s *s)
 {
 	/* set the "input" pin values */
 	s3c_gpio_set_dat(s->cpu->io, S3C_GPG(13), 1);
 	s3c_gpio_set_dat(s->cpu->io, S3C_GPG(14), 1);
 	s3c_gpio_set_dat(s->cpu->io, S3C_GPG(15), 0);
+	s3c_gpio_set_mask(s->cpu->io, 6, MINI2440_GPIO_BUTTONS, ~0);
+
+    qemu_add_kbd_event_handler(mini2440_key_event, s);
+    qemu_add_gpio_event_handler(mini2440_gpio_event, s);
 
     s3c_gpio_out_set(s->cpu->io, MINI2440_GPIO_BACKLIGHT,
                     *qemu_allocate_irqs(mini2440_bl_switch, s, 1));
@@ -238,6 +278,16 @@ static void hexdump(const void* address, uint32_t len)
 }
 #endif
 
+static int mini2440_dm9000_dma_read(void *opaque, uint8_t *buf, int len)
+{
+	return dm9000_read_block((dm9000_state *) opaque, buf, len);
+}
+
+static int mini2440_dm9000_dma_write(void *opaque, const uint8_t *buf, int len)
+{
+	return dm9000_write_block((dm9000_state *) opaque, buf, len);
+}
+
 static int mini2440_load_from_nand(NANDFlashState *nand,
 		uint32_t nand_offset, uint32_t s3c_base_offset, uint32_t size)
 {
@@ -400,6 +450,17 @@ mini2440_init(
 
     mini->cpu = s3c24xx_init(S3C_CPU_2440, 12000000 /* 12 mhz */, mini->ram, sram_base, mini->mmc);
 
+    /*
+     * Size of the host-side serial receive staging ring, 0 disables it
+     */
+    const char * uart_ring = getenv("MINI2440_UART_RING");
+
+    if (uart_ring) {
+    	int i, size = atoi(uart_ring);
+    	for (i = 0; i < 3; i++)
+    		s3c_uart_set_ring(mini->cpu->uart[i], size > 0 ? size : 0);
+    }
+
     /* Setup peripherals */
     mini2440_gpio_setup(mini);
 
@@ -411,7 +472,12 @@ mini2440_init(
 		if (!nd->model)
 		    nd->model = "dm9000";
 		if (strcmp(nd->model, "dm9000") == 0) {
-			dm9000_init(nd, 0x20000000, 0x300, 0x304, s3c_gpio_in_get(mini->cpu->io)[MINI2440_IRQ_DM9000]);
+			dm9000_state *nic = dm9000_init(nd, MINI2440_DM9000_BASE,
+					MINI2440_DM9000_ADDR, MINI2440_DM9000_DATA, s3c_gpio_in_get(mini->cpu->io)[MINI2440_IRQ_DM9000]);
+			/* 16 bit wide data port, frames can be DMAed in bulk */
+			s3c_dma_port_add(mini->cpu->dma,
+					MINI2440_DM9000_BASE + MINI2440_DM9000_DATA, 2,
+					mini2440_dm9000_dma_read, mini2440_dm9000_dma_write, nic);
 		}
 	}
 
@@ -14,8 +14,12 @@
 # include "hw.h"
 # include "flash.h"
 # include "block.h"
+# include "block_int.h"
 /* FIXME: Pass block device as an argument.  */
 # include "sysemu.h"
+# ifndef _WIN32
+#  include <sys/mman.h>
+# endif
 
 # define NAND_CMD_READ0		0x00
 # define NAND_CMD_READ1		0x01
@@ -52,6 +56,10 @@ struct NANDFlashState {
     uint8_t *storage;
     BlockDriverState *bdrv;
     int mem_oob;
+    /* Raw image mapped into our address space.  Holds the main area only
+     * if mem_oob is set, the interleaved page + OOB layout otherwise.  */
+    uint8_t *map;
+    size_t map_len;
 
     int cle, ale, ce, wp, gnd;
 
@@ -277,9 +285,60 @@ static void nand_command(NANDFlashState *s)
     }
 }
 
+static void nand_sync(NANDFlashState *s)
+{
+#ifndef _WIN32
+    if (s->map && msync(s->map, s->map_len, MS_SYNC))
+        perror("nand: msync");
+#endif
+}
+
+/* Map a raw, writable image so that page loads, programs and erases
+ * become plain memory accesses instead of sector-sized block I/O.  */
+static void nand_mmap(NANDFlashState *s)
+{
+#ifndef _WIN32
+    char format[32];
+    size_t len;
+    void *map;
+    int fd;
+
+    bdrv_get_format(s->bdrv, format, sizeof(format));
+    if (strcmp(format, "raw") || bdrv_is_read_only(s->bdrv))
+        return;
+
+    len = (size_t) s->pages << s->page_shift;
+    if (!s->mem_oob)
+        len += (size_t) s->pages << s->oob_shift;
+    if (bdrv_getlength(s->bdrv) < len)
+        return;
+
+    fd = open(s->bdrv->filename, O_RDWR | O_BINARY);
+    if (fd < 0)
+        return;
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("nand: mmap");
+        return;
+    }
+
+    s->map = map;
+    s->map_len = len;
+#endif
+}
+
 static void nand_save(QEMUFile *f, void *opaque)
 {
     NANDFlashState *s = (NANDFlashState *) opaque;
+
+    /* A page load may leave ioaddr pointing into the mapped image.  */
+    if (s->ioaddr < s->io || s->ioaddr >= s->io + sizeof(s->io)) {
+        memcpy(s->io, s->ioaddr, MAX(s->iolen, 0));
+        s->ioaddr = s->io;
+    }
+    nand_sync(s);
+
     qemu_put_byte(f, s->cle);
     qemu_put_byte(f, s->ale);
     qemu_put_byte(f, s->ce);
@@ -321,6 +380,13 @@ static int nand_load(QEMUFile *f, void *opaque, int version_id)
 
 uint32_t nand_readraw(NANDFlashState *s, uint32_t offset, void * dst, uint32_t length)
 {
+	if (s->map) {
+		if (offset >= s->map_len)
+			return 0;
+		length = MIN(length, s->map_len - offset);
+		memcpy(dst, s->map + offset, length);
+		return length;
+	}
 	if (s->bdrv) {
         if (bdrv_pread(s->bdrv, offset, dst, length) == -1) {
             printf("%s: read error in offset %i\n", __FUNCTION__, offset);
@@ -454,6 +520,58 @@ uint8_t nand_getio(NANDFlashState *s)
     return *(s->ioaddr ++);
 }
 
+/*
+ * Block variants of nand_getio / nand_setio for controllers that move
+ * more than one byte per bus access.  Data phase only, they behave as
+ * LEN consecutive single-byte calls but skip the per-byte bookkeeping.
+ */
+void nand_getio_block(NANDFlashState *s, uint8_t *buf, int len)
+{
+    int offset, n;
+
+    while (len > 0) {
+        if (!s->iolen && s->cmd == NAND_CMD_READ0) {
+            offset = (s->addr & ((1 << s->addr_shift) - 1)) + s->offset;
+            s->offset = 0;
+
+            s->blk_load(s, s->addr, offset);
+            if (s->gnd)
+                s->iolen = (1 << s->page_shift) - offset;
+            else
+                s->iolen = (1 << s->page_shift) + (1 << s->oob_shift) - offset;
+        }
+
+        if (s->ce || s->iolen <= 0) {
+            memset(buf, 0, len);
+            return;
+        }
+
+        n = MIN(len, s->iolen);
+        memcpy(buf, s->ioaddr, n);
+        s->ioaddr += n;
+        s->iolen -= n;
+        buf += n;
+        len -= n;
+    }
+}
+
+void nand_setio_block(NANDFlashState *s, const uint8_t *buf, int len)
+{
+    int n;
+
+    if (s->cle || s->ale || s->cmd != NAND_CMD_PAGEPROGRAM1) {
+        while (len --)
+            nand_setio(s, *buf ++);
+        return;
+    }
+
+    n = MIN(len, (1 << s->page_shift) + (1 << s->oob_shift) - s->iolen);
+    if (n > 0) {
+        memcpy(s->io + s->iolen, buf, n);
+        s->iolen += n;
+    }
+}
+
 NANDFlashState *nand_init(int manf_id, int chip_id)
 {
     int pagesize;
@@ -501,7 +619,9 @@ NANDFlashState *nand_init(int manf_id, int chip_id)
         s->mem_oob = 0;
     }
 
-    if (!s->bdrv)
+    if (s->bdrv)
+        nand_mmap(s);
+    else
         pagesize += 1 << s->page_shift;
     if (pagesize) {
     	printf("%s no/invalid block device, allocating %d*%d in ram\n",
@@ -520,6 +640,12 @@ NANDFlashState *nand_init(int manf_id, int chip_id)
 
 void nand_done(NANDFlashState *s)
 {
+#ifndef _WIN32
+    if (s->map) {
+        nand_sync(s);
+        munmap(s->map, s->map_len);
+    }
+#endif
     if (s->bdrv) {
         bdrv_close(s->bdrv);
         bdrv_delete(s->bdrv);
@@ -541,7 +667,25 @@ static void glue(nand_blk_write_, PAGE_SIZE)(NANDFlashState *s)
     if (PAGE(s->addr) >= s->pages)
         return;
 
-    if (!s->bdrv) {
+    if (s->map) {
+        off = (s->addr & PAGE_MASK) + s->offset;
+        if (!s->mem_oob) {
+            memcpy(s->map + PAGE_START(s->addr) + off, s->io,
+                            MIN(s->iolen, PAGE_SIZE + OOB_SIZE - off));
+        } else {
+            page = PAGE(s->addr);
+            if (off < PAGE_SIZE)
+                memcpy(s->map + (page << PAGE_SHIFT) + off, s->io,
+                                MIN(s->iolen, PAGE_SIZE - off));
+            if (off + s->iolen > PAGE_SIZE) {
+                soff = MAX(off, PAGE_SIZE);
+                memcpy(s->storage + (page << OOB_SHIFT) + soff - PAGE_SIZE,
+                                s->io + soff - off,
+                                MIN(PAGE_SIZE + OOB_SIZE, off + s->iolen) -
+                                soff);
+            }
+        }
+    } else if (!s->bdrv) {
         memcpy(s->storage + PAGE_START(s->addr) + (s->addr & PAGE_MASK) +
                         s->offset, s->io, s->iolen);
     } else if (s->mem_oob) {
@@ -589,7 +733,17 @@ static void glue(nand_blk_erase_, PAGE_SIZE)(NANDFlashState *s)
     if (PAGE(addr) >= s->pages)
         return;
 
-    if (!s->bdrv) {
+    if (s->map) {
+        if (!s->mem_oob) {
+            memset(s->map + PAGE_START(addr),
+                            0xff, (PAGE_SIZE + OOB_SIZE) << s->erase_shift);
+        } else {
+            memset(s->map + (PAGE(addr) << PAGE_SHIFT),
+                            0xff, PAGE_SIZE << s->erase_shift);
+            memset(s->storage + (PAGE(addr) << OOB_SHIFT),
+                            0xff, OOB_SIZE << s->erase_shift);
+        }
+    } else if (!s->bdrv) {
         memset(s->storage + PAGE_START(addr),
                         0xff, (PAGE_SIZE + OOB_SIZE) << s->erase_shift);
     } else if (s->mem_oob) {
@@ -631,7 +785,17 @@ static void glue(nand_blk_load_, PAGE_SIZE)(NANDFlashState *s,
     if (PAGE(addr) >= s->pages)
         return;
 
-    if (s->bdrv) {
+    if (s->map) {
+        if (!s->mem_oob) {
+            /* Serve the page straight from the mapping, no copy.  */
+            s->ioaddr = s->map + PAGE_START(addr) + offset;
+        } else {
+            memcpy(s->io, s->map + (PAGE(addr) << PAGE_SHIFT), PAGE_SIZE);
+            memcpy(s->io + PAGE_SIZE,
+                            s->storage + (PAGE(addr) << OOB_SHIFT), OOB_SIZE);
+            s->ioaddr = s->io + offset;
+        }
+    } else if (s->bdrv) {
         if (s->mem_oob) {
             if (bdrv_read(s->bdrv, SECTOR(addr), s->io, PAGE_SECTORS) == -1)
                 printf("%s: read error in sector %i\n",
@@ -24,6 +24,7 @@
 # define S3C_PIC_EINT3	3
 # define S3C_PIC_EINT4	4
 # define S3C_PIC_EINT8	5
+# define S3C_PIC_TICK	8
 # define S3C_PIC_WDT	9
 # define S3C_PIC_TIMER0	10
 # define S3C_PIC_TIMER1	11
@@ -106,15 +107,44 @@
 
 # define S3C_XTAL_FREQ	32768		/* Hz */
 
+/* CLKCON peripheral clock enable bits */
+# define S3C_CLK_NAND	4
+# define S3C_CLK_LCD	5
+# define S3C_CLK_USBH	6
+# define S3C_CLK_USBD	7
+# define S3C_CLK_PWM	8
+# define S3C_CLK_SDI	9
+# define S3C_CLK_UART0	10
+# define S3C_CLK_UART1	11
+# define S3C_CLK_UART2	12
+# define S3C_CLK_GPIO	13
+# define S3C_CLK_RTC	14
+# define S3C_CLK_ADC	15
+# define S3C_CLK_IIC	16
+# define S3C_CLK_IIS	17
+# define S3C_CLK_SPI	18
+
 /* s3c2410.c */
 struct s3c_pic_state_s;
 struct s3c_pic_state_s *s3c_pic_init(target_phys_addr_t base,
                 qemu_irq *arm_pic);
 qemu_irq *s3c_pic_get(struct s3c_pic_state_s *s);
+int s3c_pic_masked(struct s3c_pic_state_s *s, int irq);
+void s3c_pic_sleep(struct s3c_pic_state_s *s, uint32_t wakeup, qemu_irq wake);
+typedef void (*s3c_pic_sync_t)(void *opaque);
+void s3c_pic_sync_add(struct s3c_pic_state_s *s,
+                s3c_pic_sync_t fn, void *opaque);
 
+struct s3c_freq_s;
 struct s3c_dma_state_s;
-struct s3c_dma_state_s *s3c_dma_init(target_phys_addr_t base, qemu_irq *pic);
+struct s3c_dma_state_s *s3c_dma_init(struct s3c_freq_s * freq,
+                target_phys_addr_t base, qemu_irq *pic);
 qemu_irq *s3c_dma_get(struct s3c_dma_state_s *s);
+typedef int (*s3c_dma_port_read_t)(void *opaque, uint8_t *buf, int len);
+typedef int (*s3c_dma_port_write_t)(void *opaque, const uint8_t *buf, int len);
+void s3c_dma_port_add(struct s3c_dma_state_s *s, target_phys_addr_t addr,
+                int width, s3c_dma_port_read_t read,
+                s3c_dma_port_write_t write, void *opaque);
 
 /* GPIO TODO: remove this out, replace with qemu_irq or sumpthin */
 typedef void (*gpio_handler_t)(int line, int level, void *opaque);
@@ -122,7 +152,8 @@ typedef void (*gpio_handler_t)(int line, int level, void *opaque);
 struct s3c_freq_s;
 struct s3c_timers_state_s;
 struct s3c_timers_state_s *s3c_timers_init(struct s3c_freq_s * freq,
-				target_phys_addr_t base, qemu_irq *pic, qemu_irq *dma);
+				target_phys_addr_t base, struct s3c_pic_state_s *pic,
+				qemu_irq *dma);
 void s3c_timers_cmp_handler_set(void *opaque, int line,
                 gpio_handler_t handler, void *cmp_opaque);
 
@@ -131,10 +162,11 @@ struct s3c_uart_state_s;
 struct s3c_uart_state_s *s3c_uart_init(struct s3c_freq_s * freq, target_phys_addr_t base,
                 qemu_irq *irqs, qemu_irq *dma);
 void s3c_uart_attach(struct s3c_uart_state_s *s, CharDriverState *chr);
+void s3c_uart_set_ring(struct s3c_uart_state_s *s, int size);
 
 struct s3c_adc_state_s;
-struct s3c_adc_state_s *s3c_adc_init(target_phys_addr_t base, qemu_irq irq,
-                qemu_irq tcirq);
+struct s3c_adc_state_s *s3c_adc_init(struct s3c_freq_s *freq,
+                target_phys_addr_t base, qemu_irq irq, qemu_irq tcirq);
 void s3c_adc_setscale(struct s3c_adc_state_s *adc, const int m[]);
 
 struct s3c_i2c_state_s;
@@ -157,6 +189,8 @@ void s3c_gpio_out_set(struct s3c_gpio_state_s *s, int line, qemu_irq handler);
 void s3c_gpio_setpwrstat(struct s3c_gpio_state_s *s, int stat);
 void s3c_gpio_reset(struct s3c_gpio_state_s *s);
 void s3c_gpio_set_dat(struct s3c_gpio_state_s *s, int gpio, int level);
+void s3c_gpio_set_mask(struct s3c_gpio_state_s *s, int port,
+                uint32_t mask, uint32_t values);
 
 /* s3c24xx_lcd.c */
 struct s3c_lcd_state_s;
@@ -172,13 +206,14 @@ void s3c_mmci_reset(struct s3c_mmci_state_s *s);
 
 /* s3c24xx_rtc.c */
 struct s3c_rtc_state_s;
-struct s3c_rtc_state_s *s3c_rtc_init(target_phys_addr_t base, qemu_irq irq);
+struct s3c_rtc_state_s *s3c_rtc_init(target_phys_addr_t base,
+                struct s3c_pic_state_s *pic);
 void s3c_rtc_reset(struct s3c_rtc_state_s *s);
 
 /* s3c24xx_udc.c */
 struct s3c_udc_state_s;
 struct s3c_udc_state_s *s3c_udc_init(target_phys_addr_t base, qemu_irq irq,
-                qemu_irq *dma);
+                qemu_irq *dma, struct s3c_dma_state_s *dmac);
 void s3c_udc_reset(struct s3c_udc_state_s *s);
 
 struct s3c_nand_driver_s {
@@ -201,6 +236,9 @@ void s3c_spi_attach(struct s3c_spi_state_s *s, int ch,
                 uint8_t (*txrx)(void *opaque, uint8_t value),
                 uint8_t (*btxrx)(void *opaque, uint8_t value), void *opaque);
 
+typedef void (*s3c_clk_gate_t)(void *opaque, int on);
+typedef void (*s3c_clk_rate_t)(void *opaque, int changed);
+
 struct s3c_freq_s {
 	uint32_t	xtal;	/* 16 or 12Mhz : Set in init()*/
 	/* These are recalculated when the guest code changes the clock registers */
@@ -208,8 +246,36 @@ struct s3c_freq_s {
 	uint32_t	hclk;	/* SDRAM clock */
 	uint32_t	pclk;	/* peripheral clock */
 	uint32_t	uclk;
+
+	/* Peripheral clocks that are running, CLKCON unless asleep */
+	uint32_t	on;
+#define S3C_CLK_GATES	8
+	struct {
+		int bit;
+		s3c_clk_gate_t fn;
+		void *opaque;
+	} gate[S3C_CLK_GATES];
+	int		gates;
+
+	/* Told before and after the clock rates change */
+#define S3C_CLK_NOTIFIERS	8
+	struct {
+		s3c_clk_rate_t fn;
+		void *opaque;
+	} notify[S3C_CLK_NOTIFIERS];
+	int		notifiers;
 };
 
+static inline int s3c_clk_on(struct s3c_freq_s *freq, int bit)
+{
+	return (freq->on >> bit) & 1;
+}
+
+void s3c_clk_gate_add(struct s3c_freq_s *freq, int bit,
+                s3c_clk_gate_t fn, void *opaque);
+void s3c_clk_notify_add(struct s3c_freq_s *freq,
+                s3c_clk_rate_t fn, void *opaque);
+
 struct s3c_state_s {
     CPUState *env;
     struct s3c_freq_s	clock;
@@ -231,6 +297,7 @@ struct s3c_state_s {
     struct s3c_udc_state_s *udc;
     struct s3c_wdt_state_s *wdt;
     struct s3c_nand_driver_s *nand;
+    qemu_irq *wake;
 
     /* Memory controller */
     target_phys_addr_t mc_base;
@@ -239,6 +306,7 @@ struct s3c_state_s {
     /* Clock & power management */
     target_phys_addr_t clkpwr_base;
     uint32_t clkpwr_regs[6 + 1];	// 6 2410. 1 2440
+    int sleeping;
 };
 
 /* s3c2410.c */
@@ -32,102 +32,117 @@ struct s3c_pic_state_s {
     int intoffset;
     uint32_t subsrcpnd;
     uint32_t intsubmsk;
+
+    /* Sources in priority order, unless it is plain bit order */
+    int ordered;
+    uint8_t order[32];
+    /* Last levels driven on the CPU lines */
+    int irq_level;
+    int fiq_level;
+    /* Sources that end SLEEP mode, none while awake */
+    uint32_t wakeup;
+    qemu_irq wake;
+
+#define S3C_PIC_SYNCS	4
+    struct {
+        s3c_pic_sync_t fn;
+        void *opaque;
+    } sync[S3C_PIC_SYNCS];
+    int syncs;
 };
 
+/* Lets sources that don't schedule events while masked (see
+ * s3c_pic_masked) post the ones that are due.  */
+static void s3c_pic_sync(struct s3c_pic_state_s *s)
+{
+    int i;
+
+    for (i = 0; i < s->syncs; i ++)
+        s->sync[i].fn(s->sync[i].opaque);
+}
+
 static void s3c_pic_update(struct s3c_pic_state_s *s)
 {
-    qemu_set_irq(s->parent_pic[ARM_PIC_CPU_FIQ],
-                    s->srcpnd & s->intmod);
-    qemu_set_irq(s->parent_pic[ARM_PIC_CPU_IRQ],
-                    s->intpnd & ~s->intmsk & ~s->intmod);
+    int fiq = !s->wakeup && (s->srcpnd & s->intmod);
+    int irq = !s->wakeup && (s->intpnd & ~s->intmsk & ~s->intmod);
+
+    if (fiq != s->fiq_level) {
+        s->fiq_level = fiq;
+        qemu_set_irq(s->parent_pic[ARM_PIC_CPU_FIQ], fiq);
+    }
+    if (irq != s->irq_level) {
+        s->irq_level = irq;
+        qemu_set_irq(s->parent_pic[ARM_PIC_CPU_IRQ], irq);
+    }
 }
 
 /*
- * Performs interrupt arbitration and notifies the CPU.
- *
- * Since it's a complex logic which cannot be relied on by the OS
- * anyway - first because real hardware doesn't do it accurately,
- * second because it only matters when interrupts occur at the
- * same time which normally can't be predicted - we use a simpler
- * version for non-debug runs.
+ * The six first-level arbiters and the one above them only reorder
+ * some of their inputs depending on ARB_SELn, so the resulting order
+ * of the 32 sources is computed once per PRIORITY write.  With the
+ * reset value, and whenever all ARB_SELs are zero, that order is the
+ * bit order and find-first-set does the arbitration.  Rotation
+ * (ARB_MODEn) is not modelled, it can't be relied upon by the OS
+ * anyway because it only matters for simultaneous requests.
  */
-#ifdef DEBUG
-static const uint32_t s3c_arbmsk[6] = {
-    0x0000000f,
-    0x000003f0,
-    0x0000fc00,
-    0x003f0000,
-    0x0fc00000,
-    0xf0000000,
+static const uint8_t s3c_arb6_order[4][6] = {
+    { 0, 1, 2, 3, 4, 5 },
+    { 0, 2, 3, 4, 1, 5 },
+    { 0, 3, 4, 1, 2, 5 },
+    { 0, 4, 1, 2, 3, 5 },
+};
+
+static const uint8_t s3c_arb4_order[4][4] = {
+    { 0, 1, 2, 3 },
+    { 1, 2, 3, 0 },
+    { 2, 3, 0, 1 },
+    { 3, 0, 1, 2 },
+};
+
+static const struct {
+    int base, n;
+} s3c_arb_group[6] = {
+    { 0, 4 }, { 4, 6 }, { 10, 6 }, { 16, 6 }, { 22, 6 }, { 28, 4 },
 };
 
 # define S3C_ARB_SEL(i)		((s->priority >> (7 + (i << 1))) & 3)
-# define S3C_ARB_MODE(i)	((s->priority >> i) & 1)
-# define S3C_ARB_SEL_SET(i, v)	\
-    s->priority &= ~(3 << (7 + (i << 1))); \
-    s->priority |= v << (7 + (i << 1));
 
-static void s3c_pic_arbitrate(struct s3c_pic_state_s *s)
+static void s3c_pic_priority(struct s3c_pic_state_s *s)
 {
-    uint32_t pnd = s->srcpnd & ~s->intmsk & ~s->intmod;
-    int offset, i, arb;
-    if (s->intpnd || !pnd) {
-        s3c_pic_update(s);
+    int i, j, arb, sel, n = 0;
+
+    s->ordered = (s->priority >> 7) & 0x3fff;			/* ARB_SEL */
+    if (!s->ordered)
         return;
+
+    for (i = 0; i < 6; i ++) {
+        arb = s3c_arb6_order[S3C_ARB_SEL(6)][i];
+        sel = S3C_ARB_SEL(arb);
+        for (j = 0; j < s3c_arb_group[arb].n; j ++)
+            s->order[n ++] = s3c_arb_group[arb].base +
+                    (s3c_arb_group[arb].n == 4 ?
+                     s3c_arb4_order[sel][j] : s3c_arb6_order[sel][j]);
     }
+}
 
-    if (pnd & s3c_arbmsk[0]) {
-        offset = 0;
-        arb = 0;
-    } else if (pnd & 0x0ffffff0) {
-        i = S3C_ARB_SEL(6);
-        i ^= i << 1;
-        if (!(pnd & s3c_arbmsk[1 + (i & 3)]))
-            if (!(pnd & s3c_arbmsk[1 + (++ i & 3)]))
-                if (!(pnd & s3c_arbmsk[1 + (++ i & 3)]))
-                    i ++;
-
-        if (S3C_ARB_MODE(6))
-            S3C_ARB_SEL_SET(6, ((i + 1) & 3));
-        offset = (i & 3) * 6 + 4;
-        if (pnd & (1 << offset))
-            goto known_offset;
-        else if (!(pnd & (0x1f << offset))) {
-            offset += 5;
-            goto known_offset;
-        }
-        offset ++;
-        arb = (i & 3) + 1;
-    } else {
-        arb = 5;
-        offset = 28;
-    }
-
-    pnd >>= offset;
-    i = S3C_ARB_SEL(arb);
-    i ^= i << 1;
-    if (!(pnd & (1 << (i & 3))))
-        if (!(pnd & (1 << (++ i & 3))))
-            if (!(pnd & (1 << (++ i & 3))))
-                i ++;
-
-    if (S3C_ARB_MODE(arb))
-        S3C_ARB_SEL_SET(arb, ((i + 1) & 3));
-    offset += i & 3;
-known_offset:
-    s->intoffset = offset;
-    s->intpnd = 1 << offset;
-    s3c_pic_update(s);
+static inline int s3c_pic_select(struct s3c_pic_state_s *s, uint32_t pnd)
+{
+    int i;
+
+    if (likely(!s->ordered))
+        return ffs(pnd) - 1;
+    for (i = 0; !(pnd & (1 << s->order[i])); i ++);
+    return s->order[i];
 }
-#else
-inline static void s3c_pic_arbitrate(struct s3c_pic_state_s *s)
+
+/* Performs interrupt arbitration and notifies the CPU */
+static void s3c_pic_arbitrate(struct s3c_pic_state_s *s)
 {
     uint32_t pnd = s->srcpnd & ~s->intmsk & ~s->intmod;
     if (pnd && !s->intpnd)
-        s->intpnd = 1 << (s->intoffset = ffs(pnd) - 1);
+        s->intpnd = 1 << (s->intoffset = s3c_pic_select(s, pnd));
     s3c_pic_update(s);
 }
-#endif
 
 static const int s3c_sub_src_map[] = {
     [S3C_PICS_RXD0 & 31] = S3C_PIC_UART0,
@@ -143,15 +158,22 @@ static const int s3c_sub_src_map[] = {
     [S3C_PICS_ADC  & 31] = S3C_PIC_ADC,
 };
 
+/* Sub-sources of each parent source, and the parents that have any */
+static uint32_t s3c_sub_src_mask[32];
+static uint32_t s3c_sub_src_parents;
+
 static void s3c_pic_subupdate(struct s3c_pic_state_s *s)
 {
-    int next;
-    const int *sub = &s3c_sub_src_map[-1];
+    int irq;
     uint32_t pnd = s->subsrcpnd & ~s->intsubmsk;
-    while ((next = ffs(pnd))) {
-        sub += next;
-        pnd >>= next;
-        s->srcpnd |= 1 << *sub;
+    uint32_t parents = s3c_sub_src_parents;
+    while (pnd && parents) {
+        irq = ffs(parents) - 1;
+        parents &= parents - 1;
+        if (pnd & s3c_sub_src_mask[irq]) {
+            s->srcpnd |= 1 << irq;
+            pnd &= ~s3c_sub_src_mask[irq];
+        }
     }
     s3c_pic_arbitrate(s);
 }
@@ -173,19 +195,20 @@ static void s3c_pic_set_irq(void *opaque, int irq, int req)
         else
             irq = s3c_sub_src_map[irq];
     }
-    s->srcpnd |= (mask = 1 << irq);
+    if (unlikely(s->wakeup & (mask = 1 << irq)))
+        qemu_irq_raise(s->wake);
+    if (s->srcpnd & mask)
+        return;
+    s->srcpnd |= mask;
 
     /* A FIQ */
     if (s->intmod & mask)
-        qemu_irq_raise(s->parent_pic[ARM_PIC_CPU_FIQ]);
+        s3c_pic_update(s);
     else if (!s->intpnd && !(s->intmsk & mask)) {
-#ifdef DEBUG
-        s3c_pic_arbitrate(s);
-#else
+        /* Anything else unmasked and pending would have been selected */
         s->intpnd = mask;
         s->intoffset = irq;
-        qemu_irq_raise(s->parent_pic[ARM_PIC_CPU_IRQ]);
-#endif
+        s3c_pic_update(s);
     }
 }
 
@@ -199,6 +222,10 @@ static void s3c_pic_reset(struct s3c_pic_state_s *s)
     s->intoffset = 0;
     s->subsrcpnd = 0;
     s->intsubmsk = 0x7ff;
+    s->irq_level = -1;
+    s->fiq_level = -1;
+    s->wakeup = 0;
+    s3c_pic_priority(s);
     s3c_pic_update(s);
 }
 
@@ -217,6 +244,7 @@ static uint32_t s3c_pic_read(void *opaque, target_phys_addr_t addr)
 
     switch (addr) {
     case S3C_SRCPND:
+        s3c_pic_sync(s);
         return s->srcpnd;
     case S3C_INTPND:
         return s->intpnd;
@@ -246,6 +274,7 @@ static void s3c_pic_write(void *opaque, target_phys_addr_t addr,
 
     switch (addr) {
     case S3C_SRCPND:
+        s3c_pic_sync(s);
         s->srcpnd &= ~value;
         if (value & s->intmod)
             s3c_pic_update(s);
@@ -264,12 +293,16 @@ static void s3c_pic_write(void *opaque, target_phys_addr_t addr,
             s->intoffset = 0;
         }
         s3c_pic_arbitrate(s);
+        s3c_pic_sync(s);
         break;
     case S3C_INTMOD:
         s->intmod = value;
+        s3c_pic_arbitrate(s);
+        s3c_pic_sync(s);
         break;
     case S3C_PRIORITY:
         s->priority = value;
+        s3c_pic_priority(s);
         break;
     case S3C_SUBSRCPND:
         s->subsrcpnd &= ~value;
@@ -298,6 +331,9 @@ static CPUWriteMemoryFunc *s3c_pic_writefn[] = {
 static void s3c_pic_save(QEMUFile *f, void *opaque)
 {
     struct s3c_pic_state_s *s = (struct s3c_pic_state_s *) opaque;
+
+    /* Lazy sources post what is due before SRCPND goes in the stream */
+    s3c_pic_sync(s);
     qemu_put_be32s(f, &s->srcpnd);
     qemu_put_be32s(f, &s->intpnd);
     qemu_put_be32s(f, &s->intmsk);
@@ -319,6 +355,9 @@ static int s3c_pic_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_be32s(f, &s->subsrcpnd);
     qemu_get_be32s(f, &s->intsubmsk);
     s->intoffset = qemu_get_be32(f);
+    s->irq_level = -1;
+    s->fiq_level = -1;
+    s3c_pic_priority(s);
     s3c_pic_update(s);
     return 0;
 }
@@ -326,10 +365,16 @@ static int s3c_pic_load(QEMUFile *f, void *opaque, int version_id)
 struct s3c_pic_state_s *s3c_pic_init(target_phys_addr_t base,
                 qemu_irq *arm_pic)
 {
-    int iomemtype;
+    int i, iomemtype;
     struct s3c_pic_state_s *s = (struct s3c_pic_state_s *)
             qemu_mallocz(sizeof(struct s3c_pic_state_s));
 
+    for (i = 0; i < ARRAY_SIZE(s3c_sub_src_map); i ++)
+        if (s3c_sub_src_map[i]) {
+            s3c_sub_src_mask[s3c_sub_src_map[i]] |= 1 << i;
+            s3c_sub_src_parents |= 1 << s3c_sub_src_map[i];
+        }
+
     s->base = base;
     s->parent_pic = arm_pic;
     s->irqs = qemu_allocate_irqs(s3c_pic_set_irq, s, S3C_PIC_MAX);
@@ -350,6 +395,34 @@ qemu_irq *s3c_pic_get(struct s3c_pic_state_s *s)
     return s->irqs;
 }
 
+/* True if a request on IRQ would only be latched in SRCPND */
+int s3c_pic_masked(struct s3c_pic_state_s *s, int irq)
+{
+    return (s->intmsk & ~s->intmod) & (1 << irq);
+}
+
+/* While WAKEUP is non-zero the CPU lines are held inactive, requests
+ * are still latched and any of the WAKEUP sources raises WAKE.  */
+void s3c_pic_sleep(struct s3c_pic_state_s *s, uint32_t wakeup, qemu_irq wake)
+{
+    s->wakeup = wakeup;
+    s->wake = wake;
+    s3c_pic_update(s);
+}
+
+/* FN is called whenever the guest is about to look at the pending
+ * sources or has changed the masks.  */
+void s3c_pic_sync_add(struct s3c_pic_state_s *s,
+                s3c_pic_sync_t fn, void *opaque)
+{
+    if (s->syncs >= S3C_PIC_SYNCS) {
+        fprintf(stderr, "%s: too many sync handlers\n", __FUNCTION__);
+        return;
+    }
+    s->sync[s->syncs].fn = fn;
+    s->sync[s->syncs ++].opaque = opaque;
+}
+
 /* Memory controller */
 #define S3C_BWSCON	0x00	/* Bus Width & Wait Control register */
 #define S3C_BANKCON0	0x04	/* Bank 0 Control register */
@@ -449,10 +522,33 @@ static int s3c_mc_load(QEMUFile *f, void *opaque, int version_id)
 
 #define S3C2440_CAMDIVN	0x18	/* Camera Clock Divider register */
 
+/* FN is called with CHANGED clear right before the rates in FREQ
+ * change, so that work in flight can be accounted at the old rates,
+ * and with CHANGED set right after, to reschedule it.  */
+void s3c_clk_notify_add(struct s3c_freq_s *freq,
+                s3c_clk_rate_t fn, void *opaque)
+{
+    if (freq->notifiers >= S3C_CLK_NOTIFIERS) {
+        fprintf(stderr, "%s: too many clock consumers\n", __FUNCTION__);
+        return;
+    }
+    freq->notify[freq->notifiers].fn = fn;
+    freq->notify[freq->notifiers ++].opaque = opaque;
+}
+
+static void s3c_clk_notify(struct s3c_freq_s *freq, int changed)
+{
+    int i;
+
+    for (i = 0; i < freq->notifiers; i ++)
+        freq->notify[i].fn(freq->notify[i].opaque, changed);
+}
+
 static void s3c_clkpwr_update(struct s3c_state_s *s)
 {
 	uint32_t mpll[2] = { s->clkpwr_regs[S3C_MPLLCON >> 2], s->clkpwr_regs[S3C_UPLLCON >> 2] };
 	uint32_t clk[2];
+	uint32_t fclk, hclk, pclk, uclk;
 	int i;
 
 	for (i = 0; i < 2; i++) {
@@ -462,36 +558,109 @@ static void s3c_clkpwr_update(struct s3c_state_s *s)
 		clk[i] = (mdiv * s->clock.xtal * 2) / (pdiv * (1 << sdiv));
 	}
 
-	s->clock.clk = clk[0];
+	fclk = clk[0];
 	uint32_t ratio = s->clkpwr_regs[S3C_CLKDIVN >> 2];
 
 	switch( (ratio & 0x6) >> 1 ) {
 		case 0:
-			s->clock.hclk = s->clock.clk;
+			hclk = fclk;
 			break;
 		case 1:
-			s->clock.hclk = s->clock.clk/2;
+			hclk = fclk/2;
 			break;
 		case 2:
-			s->clock.hclk = s->clock.clk/4;
+			hclk = fclk/4;
 			break;
 		case 3:
-			s->clock.hclk = s->clock.clk/3;
+			hclk = fclk/3;
 			break;
 	}
 	switch ( ratio&0x1) {
 		case 0:
-			s->clock.pclk = s->clock.hclk;
+			pclk = hclk;
 			break;
 		case 1:
-			s->clock.pclk = s->clock.hclk/2;
+			pclk = hclk/2;
 			break;
 	}
-	s->clock.uclk = clk[1] / 2;
-	#define MHZ	1000000
-	printf("S3C: CLK=%d HCLK=%d PCLK=%d UCLK=%d\n",
-				s->clock.clk/MHZ, s->clock.hclk/MHZ, s->clock.pclk/MHZ,
-				s->clock.uclk/MHZ);
+	uclk = clk[1] / 2;
+
+	if (fclk == s->clock.clk && hclk == s->clock.hclk &&
+			pclk == s->clock.pclk && uclk == s->clock.uclk)
+		return;
+
+	s3c_clk_notify(&s->clock, 0);
+	s->clock.clk = fclk;
+	s->clock.hclk = hclk;
+	s->clock.pclk = pclk;
+	s->clock.uclk = uclk;
+	s3c_clk_notify(&s->clock, 1);
+}
+
+/* FN is told when the CLKCON bit BIT, or SLEEP mode, stops or
+ * restarts the peripheral's clock.  A block whose clock is stopped
+ * doesn't schedule any timers.  */
+void s3c_clk_gate_add(struct s3c_freq_s *freq, int bit,
+                s3c_clk_gate_t fn, void *opaque)
+{
+    if (freq->gates >= S3C_CLK_GATES) {
+        fprintf(stderr, "%s: too many clock consumers\n", __FUNCTION__);
+        return;
+    }
+    freq->gate[freq->gates].bit = bit;
+    freq->gate[freq->gates].fn = fn;
+    freq->gate[freq->gates ++].opaque = opaque;
+}
+
+static void s3c_clk_gate_update(struct s3c_freq_s *freq, uint32_t on)
+{
+    uint32_t diff = freq->on ^ on;
+    int i;
+
+    freq->on = on;
+    for (i = 0; i < freq->gates; i ++)
+        if ((diff >> freq->gate[i].bit) & 1)
+            freq->gate[i].fn(freq->gate[i].opaque,
+                            (on >> freq->gate[i].bit) & 1);
+}
+
+/* EINT0-15 and the RTC alarm end SLEEP mode */
+#define S3C_WAKEUP_SOURCES	((1 << S3C_PIC_EINT0) | (1 << S3C_PIC_EINT1) | \
+                (1 << S3C_PIC_EINT2) | (1 << S3C_PIC_EINT3) | \
+                (1 << S3C_PIC_EINT4) | (1 << S3C_PIC_EINT8) | \
+                (1 << S3C_PIC_RTC))
+
+static void s3c_clkpwr_reset(struct s3c_state_s *s);
+
+/*
+ * SLEEP mode powers the core and all peripheral clocks down.  Only a
+ * wake-up source request brings the chip back, through a reset of the
+ * core, with GSTATUS2 telling the boot code where it came from.
+ */
+static void s3c_sleep(struct s3c_state_s *s)
+{
+    s->sleeping = 1;
+    s3c_clk_gate_update(&s->clock, 0);
+    s3c_pic_sleep(s->pic, S3C_WAKEUP_SOURCES, s->wake[0]);
+    cpu_interrupt(s->env, CPU_INTERRUPT_HALT);
+}
+
+static void s3c_wakeup(void *opaque, int line, int level)
+{
+    struct s3c_state_s *s = (struct s3c_state_s *) opaque;
+
+    if (!level)
+        return;
+
+    s->sleeping = 0;
+    s3c_clkpwr_reset(s);
+    s3c_gpio_setpwrstat(s->io, 2);
+    cpu_reset(s->env);
+    s->env->interrupt_request &= ~CPU_INTERRUPT_HALT;
+    s->env->halted = 0;
+
+    /* After the CPU reset, so that pending interrupts reach the core */
+    s3c_pic_sleep(s->pic, 0, NULL);
 }
 
 static void s3c_clkpwr_reset(struct s3c_state_s *s)
@@ -504,6 +673,7 @@ static void s3c_clkpwr_reset(struct s3c_state_s *s)
     s->clkpwr_regs[S3C_CLKDIVN >> 2] = 0x00000000;
     s->clkpwr_regs[S3C2440_CAMDIVN >> 2] = 0x00000000;
     s3c_clkpwr_update(s);
+    s3c_clk_gate_update(&s->clock, s->clkpwr_regs[S3C_CLKCON >> 2]);
 }
 
 static uint32_t s3c_clkpwr_read(void *opaque, target_phys_addr_t addr)
@@ -538,21 +708,18 @@ static void s3c_clkpwr_write(void *opaque, target_phys_addr_t addr,
         	s3c_clkpwr_update(s);
         break;
     case S3C_CLKCON:
-        if (value & (1 << 3)) {
-            cpu_interrupt(s->env, CPU_INTERRUPT_HALT);
-            printf("%s: processor powered off\n", __FUNCTION__);
-            s3c_gpio_setpwrstat(s->io, 2);
-#if 0
-            cpu_reset(s->env);
-            s->env->regs[15] = 0;	/* XXX */
-#endif
-        } else
-            if (value & (1 << 2))	/* Normal IDLE mode */
-                cpu_interrupt(s->env, CPU_INTERRUPT_HALT);
         if ((s->clkpwr_regs[addr >> 2] ^ value) & 1)
             printf("%s: SPECIAL mode %s\n", __FUNCTION__,
                             (value & 1) ? "on" : "off");
         s->clkpwr_regs[addr >> 2] = value;
+        s3c_clk_gate_update(&s->clock, value);
+
+        if (value & (1 << 3))		/* SLEEP mode */
+            s3c_sleep(s);
+        else if (value & (1 << 2))	/* Normal IDLE mode */
+            /* The CPU stays halted until the PIC raises IRQ or FIQ,
+             * peripherals keep running.  */
+            cpu_interrupt(s->env, CPU_INTERRUPT_HALT);
         break;
     case S3C_CLKSLOW:
         if ((s->clkpwr_regs[addr >> 2] ^ value) & (1 << 4))
@@ -588,6 +755,7 @@ static void s3c_clkpwr_save(QEMUFile *f, void *opaque)
     int i;
     for (i = 0; i < 7; i ++)
         qemu_put_be32s(f, &s->clkpwr_regs[i]);
+    qemu_put_be32(f, s->sleeping);
 }
 
 static int s3c_clkpwr_load(QEMUFile *f, void *opaque, int version_id)
@@ -596,17 +764,35 @@ static int s3c_clkpwr_load(QEMUFile *f, void *opaque, int version_id)
     int i;
     for (i = 0; i < 7; i ++)
         qemu_get_be32s(f, &s->clkpwr_regs[i]);
+    if (version_id >= 1)
+        s->sleeping = qemu_get_be32(f);
+    else
+        s->sleeping = 0;
+    s3c_clkpwr_update(s);
+
+    /* The CPU's halted state isn't saved, re-enter SLEEP mode fully */
+    if (s->sleeping)
+        s3c_sleep(s);
+    else {
+        s3c_pic_sleep(s->pic, 0, NULL);
+        s3c_clk_gate_update(&s->clock, s->clkpwr_regs[S3C_CLKCON >> 2]);
+    }
     return 0;
 }
 
 /* DMA controller */
 #define S3C_DMA_CH_N	4
+#define S3C_DMA_CHUNK	4096	/* Bytes moved per scheduling step */
+#define S3C_DMA_PORTS	8
 
 struct s3c_dma_ch_state_s;
 struct s3c_dma_state_s {	/* Modelled as an interrupt controller */
+    struct s3c_freq_s * freq;
     target_phys_addr_t base;
     qemu_irq *drqs;
     struct s3c_dma_ch_state_s {
+        struct s3c_dma_state_s *s;
+        QEMUTimer *tm;
         qemu_irq intr;
         int curr_tc;
         int req;
@@ -620,24 +806,171 @@ struct s3c_dma_state_s {	/* Modelled as an interrupt controller */
         uint32_t cdst;
         uint32_t mask;
     } ch[S3C_DMA_CH_N];
+
+    /* FIFO data registers that can be streamed in bulk */
+    struct s3c_dma_port_s {
+        target_phys_addr_t addr;
+        int width;
+        s3c_dma_port_read_t read;
+        s3c_dma_port_write_t write;
+        void *opaque;
+    } port[S3C_DMA_PORTS];
+    int ports;
 };
 
-static inline void s3c_dma_ch_run(struct s3c_dma_state_s *s,
+static inline int s3c_dma_is_ram(target_phys_addr_t addr)
+{
+    return (cpu_get_physical_page_desc(addr) & ~TARGET_PAGE_MASK) ==
+            IO_MEM_RAM;
+}
+
+static struct s3c_dma_port_s *s3c_dma_port(struct s3c_dma_state_s *s,
+                target_phys_addr_t addr, int width)
+{
+    int i;
+
+    for (i = 0; i < s->ports; i ++)
+        if (s->port[i].addr == addr && s->port[i].width == width)
+            return &s->port[i];
+    return 0;
+}
+
+/*
+ * Moves between a fixed-address FIFO port and incrementing RAM with a
+ * single call into the device.  Returns the number of units moved, zero
+ * if the device wants the per-unit path.
+ */
+static int s3c_dma_ch_port(struct s3c_dma_ch_state_s *ch, int unit, int units)
+{
+    int width = 1 << ((ch->con >> 20) & 3);			/* DSZ */
+    target_phys_addr_t len = (target_phys_addr_t) unit * units;
+    struct s3c_dma_port_s *port;
+    uint8_t *buf;
+    int n, is_write;
+
+    if ((ch->isrcc & 1) && !(ch->idstc & 1)) {			/* INC */
+        port = s3c_dma_port(ch->s, ch->csrc, width);
+        if (!port || !port->read || !s3c_dma_is_ram(ch->cdst))
+            return 0;
+        is_write = 1;
+        buf = cpu_physical_memory_map(ch->cdst, &len, 1);
+    } else if (!(ch->isrcc & 1) && (ch->idstc & 1)) {		/* INC */
+        port = s3c_dma_port(ch->s, ch->cdst, width);
+        if (!port || !port->write || !s3c_dma_is_ram(ch->csrc))
+            return 0;
+        is_write = 0;
+        buf = cpu_physical_memory_map(ch->csrc, &len, 0);
+    } else
+        return 0;
+    if (!buf)
+        return 0;
+
+    len -= len % unit;
+    if (is_write)
+        n = port->read(port->opaque, buf, len);
+    else
+        n = port->write(port->opaque, buf, len);
+    n -= n % unit;
+    cpu_physical_memory_unmap(buf, len, is_write, n);
+
+    if (is_write)
+        ch->cdst += n;
+    else
+        ch->csrc += n;
+    return n / unit;
+}
+
+/* Lets the channels stream to and from the data register at ADDR when
+ * it is accessed WIDTH bytes at a time */
+void s3c_dma_port_add(struct s3c_dma_state_s *s, target_phys_addr_t addr,
+                int width, s3c_dma_port_read_t read,
+                s3c_dma_port_write_t write, void *opaque)
+{
+    struct s3c_dma_port_s *port;
+
+    if (s->ports >= S3C_DMA_PORTS) {
+        fprintf(stderr, "%s: too many ports\n", __FUNCTION__);
+        return;
+    }
+    port = &s->port[s->ports ++];
+    port->addr = addr;
+    port->width = width;
+    port->read = read;
+    port->write = write;
+    port->opaque = opaque;
+}
+
+/*
+ * Moves up to UNITS transfer units of UNIT bytes each with a single
+ * memcpy when both ends are incrementing addresses in RAM, or through
+ * a registered port.  Returns
+ * the number of units moved, zero if the per-unit path has to be used
+ * (fixed address, MMIO endpoint, overlapping or unmappable ranges).
+ */
+static int s3c_dma_ch_bulk(struct s3c_dma_ch_state_s *ch, int unit, int units)
+{
+    target_phys_addr_t len = (target_phys_addr_t) unit * units;
+    target_phys_addr_t slen = len, dlen = len;
+    uint8_t *src, *dst;
+
+    if ((ch->isrcc & 1) || (ch->idstc & 1))			/* INC */
+        return s3c_dma_ch_port(ch, unit, units);
+    if (!s3c_dma_is_ram(ch->csrc) || !s3c_dma_is_ram(ch->cdst))
+        return 0;
+    /* Overlapping ranges would not behave like a unit-by-unit copy.  */
+    if (ch->csrc < ch->cdst + len && ch->cdst < ch->csrc + len)
+        return 0;
+
+    src = cpu_physical_memory_map(ch->csrc, &slen, 0);
+    if (!src)
+        return 0;
+    dst = cpu_physical_memory_map(ch->cdst, &dlen, 1);
+    if (!dst) {
+        cpu_physical_memory_unmap(src, slen, 0, 0);
+        return 0;
+    }
+
+    len = MIN(slen, dlen);
+    len -= len % unit;
+    memcpy(dst, src, len);
+
+    cpu_physical_memory_unmap(dst, dlen, 1, len);
+    cpu_physical_memory_unmap(src, slen, 0, len);
+
+    ch->csrc += len;
+    ch->cdst += len;
+    return len / unit;
+}
+
+/*
+ * Moves at most S3C_DMA_CHUNK bytes and schedules the channel timer to
+ * expire when the bus would have finished moving them.  The transfer is
+ * continued, or completed, from the timer so that the guest keeps
+ * running while long transfers are in flight.
+ */
+static void s3c_dma_ch_run(struct s3c_dma_state_s *s,
                 struct s3c_dma_ch_state_s *ch)
 {
-    int width, burst, t;
+    int width, burst, t, n, units;
+    uint32_t clk;
     uint8_t buffer[4];
     width = 1 << ((ch->con >> 20) & 3);				/* DSZ */
     burst = (ch->con & (1 << 28)) ? 4 : 1;			/* TSZ */
 
-    while (!ch->running && ch->curr_tc > 0 && ch->req &&
-                    (ch->mask & (1 << 1))) {		/* ON_OFF */
-        if (width > sizeof(buffer)) {
-            printf("%s: wrong access width\n", __FUNCTION__);
-            return;
-        }
-        ch->running = 1;
-        while (ch->curr_tc --) {
+    if (ch->running || ch->curr_tc <= 0 || !ch->req ||
+                    !(ch->mask & (1 << 1)))			/* ON_OFF */
+        return;
+    if (width > sizeof(buffer)) {
+        printf("%s: wrong access width\n", __FUNCTION__);
+        return;
+    }
+
+    ch->running = 1;
+    units = 0;
+    while (ch->curr_tc > 0 && units < MAX(S3C_DMA_CHUNK / width / burst, 1)) {
+        n = s3c_dma_ch_bulk(ch, width * burst, MIN(ch->curr_tc,
+                                S3C_DMA_CHUNK / width / burst - units));
+        if (!n) {
             for (t = 0; t < burst; t ++) {
                 cpu_physical_memory_read(ch->csrc, buffer, width);
                 cpu_physical_memory_write(ch->cdst, buffer, width);
@@ -647,41 +980,58 @@ static inline void s3c_dma_ch_run(struct s3c_dma_state_s *s,
                 if (!(ch->idstc & 1))				/* INT */
                     ch->cdst += width;
             }
-
-            if (!(ch->con & (1 << 27)) && !ch->req)		/* SERVMODE */
-                break;
+            n = 1;
         }
-        ch->running = 0;
+        ch->curr_tc -= n;
+        units += n;
+
+        /* A single service transfer stops once the device drops DREQ */
+        if (!(ch->con & (1 << 27)) && !ch->req)		/* SERVMODE */
+            break;
+    }
+
+    /* Each beat is a read and a write cycle on the selected bus clock */
+    clk = (ch->con & (1 << 30)) ? s->freq->hclk : s->freq->pclk;	/* SYNC */
+    qemu_mod_timer(ch->tm, qemu_get_clock(vm_clock) +
+                    muldiv64(units * burst * 2, ticks_per_sec, clk));
+}
 
+static void s3c_dma_ch_tick(void *opaque)
+{
+    struct s3c_dma_ch_state_s *ch = (struct s3c_dma_ch_state_s *) opaque;
+    struct s3c_dma_state_s *s = ch->s;
+
+    if (!ch->running)
+        return;
+    ch->running = 0;
+
+    if (ch->curr_tc <= 0) {
         if (!(ch->con & (1 << 23))) {				/* SWHW_SEL */
             ch->req = 0;
         }
 
-        if (ch->curr_tc <= 0) {
-            if (ch->con & (1 << 22))				/* RELOAD */
-                ch->mask &= ~(1 << 1);				/* ON_OFF */
-            else {
-                if (!(ch->con & (1 << 23))) {			/* SWHW_SEL */
-                    printf("%s: auto-reload software controlled transfer\n",
-                                    __FUNCTION__);
-                    break;
-                }
-                ch->csrc = ch->isrc;				/* S_ADDR */
-                ch->cdst = ch->idst;				/* D_ADDR */
-                ch->curr_tc = ch->con & 0xfffff;		/* TC */
-                ch->con |= 1 << 22;				/* ON_OFF */
+        if (ch->con & (1 << 22))				/* RELOAD */
+            ch->mask &= ~(1 << 1);				/* ON_OFF */
+        else {
+            if (!(ch->con & (1 << 23))) {			/* SWHW_SEL */
+                printf("%s: auto-reload software controlled transfer\n",
+                                __FUNCTION__);
+                return;
             }
+            ch->csrc = ch->isrc;				/* S_ADDR */
+            ch->cdst = ch->idst;				/* D_ADDR */
+            ch->curr_tc = ch->con & 0xfffff;			/* TC */
+            ch->con |= 1 << 22;					/* ON_OFF */
+        }
 
-            if (ch->con & (1 << 31))				/* DMD_HS */
-                ch->req = 0;
+        if (ch->con & (1 << 31))				/* DMD_HS */
+            ch->req = 0;
 
-            if (ch->con & (1 << 29)) {				/* INT */
-                qemu_irq_raise(ch->intr);
-                /* Give the system a chance to respond.  */
-                break;
-            }
-        }
+        if (ch->con & (1 << 29))				/* INT */
+            qemu_irq_raise(ch->intr);
     }
+
+    s3c_dma_ch_run(s, ch);
 }
 
 static void s3c_dma_reset(struct s3c_dma_state_s *s)
@@ -699,6 +1049,8 @@ static void s3c_dma_reset(struct s3c_dma_state_s *s)
         s->ch[i].csrc = 0;
         s->ch[i].cdst = 0;
         s->ch[i].mask = 0;
+        s->ch[i].running = 0;
+        qemu_del_timer(s->ch[i].tm);
     }
 }
 
@@ -746,7 +1098,7 @@ static uint32_t s3c_dma_read(void *opaque, target_phys_addr_t addr)
     case S3C_DCON:
         return ch->con;
     case S3C_DSTAT:
-        return ch->curr_tc;
+        return (ch->running << 20) | (ch->curr_tc & 0xfffff);	/* STAT */
     case S3C_DCSRC:
         return ch->csrc;
     case S3C_DCDST:
@@ -797,6 +1149,8 @@ static void s3c_dma_write(void *opaque, target_phys_addr_t addr,
         ch->mask = value;
         if (value & (1 << 2)) {					/* STOP */
             ch->mask &= ~(3 << 1);				/* ON_OFF */
+            ch->running = 0;
+            qemu_del_timer(ch->tm);
         } else if (!(ch->con & (1 << 23))) {			/* SWHW_SEL */
             ch->req = value & 1;				/* SW_TRIG */
             s3c_dma_ch_run(s, ch);
@@ -834,6 +1188,8 @@ static void s3c_dma_save(QEMUFile *f, void *opaque)
         qemu_put_be32s(f, &s->ch[i].csrc);
         qemu_put_be32s(f, &s->ch[i].cdst);
         qemu_put_be32s(f, &s->ch[i].mask);
+        qemu_put_be32(f, s->ch[i].running);
+        qemu_put_timer(f, s->ch[i].tm);
     }
 }
 
@@ -852,21 +1208,31 @@ static int s3c_dma_load(QEMUFile *f, void *opaque, int version_id)
         qemu_get_be32s(f, &s->ch[i].csrc);
         qemu_get_be32s(f, &s->ch[i].cdst);
         qemu_get_be32s(f, &s->ch[i].mask);
+        if (version_id >= 1) {
+            s->ch[i].running = qemu_get_be32(f);
+            qemu_get_timer(f, s->ch[i].tm);
+        } else {
+            s->ch[i].running = 0;
+            s3c_dma_ch_run(s, &s->ch[i]);
+        }
     }
     return 0;
 }
 
-struct s3c_dma_state_s *s3c_dma_init(target_phys_addr_t base, qemu_irq *pic)
+struct s3c_dma_state_s *s3c_dma_init(struct s3c_freq_s * freq,
+                target_phys_addr_t base, qemu_irq *pic)
 {
-    int iomemtype;
+    int i, iomemtype;
     struct s3c_dma_state_s *s = (struct s3c_dma_state_s *)
             qemu_mallocz(sizeof(struct s3c_dma_state_s));
 
+    s->freq = freq;
     s->base = base;
-    s->ch[0].intr = pic[0];
-    s->ch[1].intr = pic[1];
-    s->ch[2].intr = pic[2];
-    s->ch[3].intr = pic[3];
+    for (i = 0; i < S3C_DMA_CH_N; i ++) {
+        s->ch[i].s = s;
+        s->ch[i].intr = pic[i];
+        s->ch[i].tm = qemu_new_timer(vm_clock, s3c_dma_ch_tick, &s->ch[i]);
+    }
     s->drqs = qemu_allocate_irqs(s3c_dma_dreq, s, S3C_RQ_MAX);
 
     s3c_dma_reset(s);
@@ -875,7 +1241,7 @@ struct s3c_dma_state_s *s3c_dma_init(target_phys_addr_t base, qemu_irq *pic)
                     s3c_dma_writefn, s);
     cpu_register_physical_memory(s->base, 0xffffff, iomemtype);
 
-    register_savevm("s3c24xx_dma", 0, 0, s3c_dma_save, s3c_dma_load, s);
+    register_savevm("s3c24xx_dma", 0, 1, s3c_dma_save, s3c_dma_load, s);
 
     return s;
 }
@@ -890,6 +1256,7 @@ struct s3c_timer_state_s;
 struct s3c_timers_state_s {
 	struct s3c_freq_s * freq;
     target_phys_addr_t base;
+    struct s3c_pic_state_s *pic;
     qemu_irq *dma;
     DisplayState *ds;
     struct s3c_timer_state_s {
@@ -913,42 +1280,127 @@ struct s3c_timers_state_s {
 
 static const int s3c_tm_bits[] = { 0, 8, 12, 16, 20 };
 
-static uint16_t s3c_timers_get(struct s3c_timers_state_s *s, int tm)
+static inline int64_t s3c_timers_period(struct s3c_timer_state_s *t)
+{
+    return muldiv64(t->count, ticks_per_sec, t->divider);
+}
+
+static void s3c_timers_divider(struct s3c_timers_state_s *s, int tm)
+{
+    s->timer[tm].divider = s->freq->pclk >>
+            (((s->config[1] >> (tm * 4)) & 3) + 1);
+    if (tm < 2)
+        s->timer[tm].divider /= ((s->config[0] >> 0) & 0xff) + 1;
+    else
+        s->timer[tm].divider /= ((s->config[0] >> 8) & 0xff) + 1;
+}
+
+/*
+ * An auto-reloading timer whose interrupt is masked and which doesn't
+ * feed the DMA has no host timer behind it: nobody can see it expire
+ * other than by reading TCNTO or SRCPND, and both catch up on demand.
+ */
+static int s3c_timers_lazy(struct s3c_timers_state_s *s, int tm)
 {
-    uint16_t elapsed;
+    if (!(s->control & (1 << ((tm == 4) ? 22 : (s3c_tm_bits[tm] + 3)))))
+        return 0;					/* Auto-reload */
+    if (((s->config[1] >> 20) & 0xf) == tm + 1)		/* DMA mode */
+        return 0;
+    return s3c_pic_masked(s->pic, S3C_PIC_TIMER0 + tm);
+}
+
+/*
+ * Posts the expiry of the current period if it has passed, folding any
+ * further whole periods that went by into the same event, and arms the
+ * host timer for the next one unless the timer can be lazy.
+ */
+static void s3c_timers_update(struct s3c_timers_state_s *s, int tm)
+{
+    struct s3c_timer_state_s *t = &s->timer[tm];
+    int64_t now, expire, period;
+
+    if (!t->running)
+        return;
+
+    now = qemu_get_clock(vm_clock);
+    expire = t->reload + s3c_timers_period(t);
+    if (now >= expire) {
+        if (((s->config[1] >> 20) & 0xf) == tm + 1) {
+            qemu_irq_raise(s->dma[S3C_RQ_TIMER0]);	/* TODO */
+            qemu_irq_raise(s->dma[S3C_RQ_TIMER1]);
+            qemu_irq_raise(s->dma[S3C_RQ_TIMER2]);
+        } else
+            qemu_irq_raise(t->irq);
+
+        if (!(s->control & (1 << ((tm == 4) ? 22 : (s3c_tm_bits[tm] + 3))))) {
+            t->running = 0;
+            t->count = 0;
+            s->control &= ~(1 << s3c_tm_bits[tm]);
+            qemu_del_timer(t->t);
+            return;
+        }
+
+        /* Auto-reload */
+        t->count = s->countb[tm];
+        s3c_timers_divider(s, tm);
+        t->reload = expire;
+        period = s3c_timers_period(t);
+        if (period && now >= expire + period)
+            t->reload += (now - expire) / period * period;
+    }
+
+    if (s3c_timers_lazy(s, tm))
+        qemu_del_timer(t->t);
+    else
+        qemu_mod_timer(t->t, t->reload + s3c_timers_period(t));
+}
+
+static void s3c_timers_sync(void *opaque)
+{
+    struct s3c_timers_state_s *s = (struct s3c_timers_state_s *) opaque;
+    int i;
+
+    for (i = 0; i < 5; i ++)
+        s3c_timers_update(s, i);
+}
+
+/* Ticks left in the current period, an expiry not yet posted reads 0 */
+static uint16_t s3c_timers_count(struct s3c_timers_state_s *s, int tm)
+{
+    int64_t elapsed;
     if (!s->timer[tm].running)
         return s->timer[tm].count;
 
     elapsed = muldiv64(qemu_get_clock(vm_clock) - s->timer[tm].reload,
                     s->timer[tm].divider, ticks_per_sec);
     if (unlikely(elapsed > s->timer[tm].count))
-        return s->timer[tm].count;
+        return 0;
 
     return s->timer[tm].count - elapsed;
 }
 
+static uint16_t s3c_timers_get(struct s3c_timers_state_s *s, int tm)
+{
+    s3c_timers_update(s, tm);
+    return s3c_timers_count(s, tm);
+}
+
 static void s3c_timers_stop(struct s3c_timers_state_s *s, int tm)
 {
     s->timer[tm].count = s3c_timers_get(s, tm);
     s->timer[tm].running = 0;
+    qemu_del_timer(s->timer[tm].t);
 }
 
 static void s3c_timers_start(struct s3c_timers_state_s *s, int tm)
 {
-    if (s->timer[tm].running)
+    if (s->timer[tm].running || !s3c_clk_on(s->freq, S3C_CLK_PWM))
         return;
 
-    s->timer[tm].divider = s->freq->pclk >>
-            (((s->config[1] >> (tm * 4)) & 3) + 1);
-    if (tm < 2)
-        s->timer[tm].divider /= ((s->config[0] >> 0) & 0xff) + 1;
-    else
-        s->timer[tm].divider /= ((s->config[0] >> 8) & 0xff) + 1;
+    s3c_timers_divider(s, tm);
     s->timer[tm].running = 1;
     s->timer[tm].reload = qemu_get_clock(vm_clock);
-    qemu_mod_timer(s->timer[tm].t,
-                    s->timer[tm].reload + muldiv64(s->timer[tm].count,
-                            ticks_per_sec, s->timer[tm].divider));
+    s3c_timers_update(s, tm);
 }
 
 static void s3c_timers_reset(struct s3c_timers_state_s *s)
@@ -968,29 +1420,26 @@ static void s3c_timers_reset(struct s3c_timers_state_s *s)
         s->compareb[i] = 0x0000;
 }
 
-static void s3c_timers_tick(void *opaque)
+/* Timers freeze while PCLK to the block is off and resume from the
+ * same count when it comes back.  The same happens around a PCLK
+ * rate change, so that the rest of the period runs at the new rate.  */
+static void s3c_timers_gate(void *opaque, int on)
 {
-    struct s3c_timer_state_s *t = (struct s3c_timer_state_s *) opaque;
-    struct s3c_timers_state_s *s = t->s;
-    if (!t->running)
-        return;
+    struct s3c_timers_state_s *s = (struct s3c_timers_state_s *) opaque;
+    int i;
 
-    if (((s->config[1] >> 20) & 0xf) == t->n + 1) {
-        qemu_irq_raise(s->dma[S3C_RQ_TIMER0]);	/* TODO */
-        qemu_irq_raise(s->dma[S3C_RQ_TIMER1]);
-        qemu_irq_raise(s->dma[S3C_RQ_TIMER2]);
-    } else
-        qemu_irq_raise(t->irq);
+    for (i = 0; i < 5; i ++)
+        if (!on && s->timer[i].running)
+            s3c_timers_stop(s, i);
+        else if (on && ((s->control >> s3c_tm_bits[i]) & 1))
+            s3c_timers_start(s, i);
+}
 
-    t->running = 0;
-    t->count = 0;
+static void s3c_timers_tick(void *opaque)
+{
+    struct s3c_timer_state_s *t = (struct s3c_timer_state_s *) opaque;
 
-    if (s->control & (1 << ((t->n == 4) ? 22 : (s3c_tm_bits[t->n] + 3)))) {
-        /* Auto-reload */
-        t->count = s->countb[t->n];
-        s3c_timers_start(s, t->n);
-    } else
-        s->control &= ~(1 << s3c_tm_bits[t->n]);
+    s3c_timers_update(t->s, t->n);
 }
 
 #define S3C_TCFG0	0x00	/* Timer Configuration register 0 */
@@ -1055,12 +1504,16 @@ static void s3c_timers_write(void *opaque, target_phys_addr_t addr,
 
     switch (addr) {
     case S3C_TCFG0:
+        s3c_timers_sync(s);
         s->config[0] = value & 0x00ffffff;
         break;
     case S3C_TCFG1:
+        s3c_timers_sync(s);
         s->config[1] = value & 0x00ffffff;
+        s3c_timers_sync(s);
         break;
     case S3C_TCON:
+        s3c_timers_sync(s);
         for (tm = 0; tm < 5; tm ++) {
             if (value & (2 << (s3c_tm_bits[tm]))) {
                 if (s->timer[tm].running) {
@@ -1079,6 +1532,8 @@ static void s3c_timers_write(void *opaque, target_phys_addr_t addr,
         }
 
         s->control = value & 0x007fff1f;
+        /* Auto-reload may have changed */
+        s3c_timers_sync(s);
         break;
     case S3C_TCMPB3:    tm ++;
     case S3C_TCMPB2:    tm ++;
@@ -1093,6 +1548,7 @@ static void s3c_timers_write(void *opaque, target_phys_addr_t addr,
     case S3C_TCNTB2:    tm ++;
     case S3C_TCNTB1:    tm ++;
     case S3C_TCNTB0:
+        s3c_timers_update(s, tm);
         s->countb[tm] = value & 0xffff;
         break;
     default:
@@ -1119,7 +1575,7 @@ static void s3c_timers_save(QEMUFile *f, void *opaque)
     for (i = 0; i < 5; i ++) {
         qemu_put_be32(f, s->timer[i].running);
         qemu_put_be32s(f, &s->timer[i].divider);
-        qemu_put_be16(f, s3c_timers_get(s, i));
+        qemu_put_be16(f, s3c_timers_count(s, i));
         qemu_put_sbe64s(f, &s->timer[i].reload);
     }
 
@@ -1160,7 +1616,7 @@ static int s3c_timers_load(QEMUFile *f, void *opaque, int version_id)
 }
 
 struct s3c_timers_state_s *s3c_timers_init(struct s3c_freq_s * freq, target_phys_addr_t base,
-                qemu_irq *pic, qemu_irq *dma)
+                struct s3c_pic_state_s *pic, qemu_irq *dma)
 {
     int i, iomemtype;
     struct s3c_timers_state_s *s = (struct s3c_timers_state_s *)
@@ -1168,6 +1624,7 @@ struct s3c_timers_state_s *s3c_timers_init(struct s3c_freq_s * freq, target_phys
 
     s->freq = freq;
     s->base = base;
+    s->pic = pic;
     s->dma = dma;
 
     s3c_timers_reset(s);
@@ -1178,8 +1635,11 @@ struct s3c_timers_state_s *s3c_timers_init(struct s3c_freq_s * freq, target_phys
         s->timer[i].s = s;
         s->timer[i].n = i;
         s->timer[i].cmp_cb = 0;
-        s->timer[i].irq = pic[i];
+        s->timer[i].irq = s3c_pic_get(pic)[S3C_PIC_TIMER0 + i];
     }
+    s3c_pic_sync_add(pic, s3c_timers_sync, s);
+    s3c_clk_gate_add(freq, S3C_CLK_PWM, s3c_timers_gate, s);
+    s3c_clk_notify_add(freq, s3c_timers_gate, s);
 
     iomemtype = cpu_register_io_memory(0, s3c_timers_readfn,
                     s3c_timers_writefn, s);
@@ -1204,6 +1664,8 @@ void s3c_timers_cmp_handler_set(void *opaque, int line,
 }
 
 /* UART */
+#define S3C_UART_RING	4096	/* Default host-side Rx staging size */
+
 struct s3c_uart_state_s {
     struct s3c_freq_s * freq;
     target_phys_addr_t base;
@@ -1213,6 +1675,15 @@ struct s3c_uart_state_s {
     uint8_t rxfifo[16];
     int rxstart;
     int rxlen;
+    QEMUTimer *rxtimer;
+    int rxtimeout;
+    int clk;
+
+    /* Characters received from the host that don't fit in the FIFO yet */
+    uint8_t *ring;
+    int ringsize;
+    int ringstart;
+    int ringlen;
 #define UART_MAX_CHR	4
     int chr_num;
     CharDriverState *chr[UART_MAX_CHR];
@@ -1235,6 +1706,10 @@ static void s3c_uart_reset(struct s3c_uart_state_s *s)
 
     s->rxstart = 0;
     s->rxlen = 0;
+    s->rxtimeout = 0;
+    qemu_del_timer(s->rxtimer);
+    s->ringstart = 0;
+    s->ringlen = 0;
 }
 
 static void s3c_uart_err(struct s3c_uart_state_s *s, int err)
@@ -1244,50 +1719,117 @@ static void s3c_uart_err(struct s3c_uart_state_s *s, int err)
         qemu_irq_raise(s->irq[2]);
 }
 
+/* Rx data is available at the FIFO trigger level or after a timeout */
+static inline int s3c_uart_rx_ready(struct s3c_uart_state_s *s)
+{
+    if (!s->rxlen)
+        return 0;
+    if (!(s->fcontrol & 1))			/* FIFOEnable */
+        return 1;
+    return s->rxlen >= (((s->fcontrol >> 4) & 3) + 1) * 4 ||
+            (s->rxtimeout && (s->control & (1 << 7)));	/* RxTimeOutEnable */
+}
+
+/* The DMA request is a level that drops when there's nothing to move */
+static void s3c_uart_dma_update(struct s3c_uart_state_s *s)
+{
+    qemu_set_irq(s->dma[0],
+                    (((s->control >> 0) & 3) >= 2 &&	/* ReceiveMode */
+                     s3c_uart_rx_ready(s)) ||
+                    ((s->control >> 2) & 3) >= 2);	/* TransmitMode */
+}
+
 inline static void s3c_uart_full(struct s3c_uart_state_s *s, int pulse)
 {
-    if (s->fcontrol & 1)			/* FIFOEnable */
-        if (s->rxlen < (((s->fcontrol >> 4) & 3) + 1) * 4) {
-            if (((s->control >> 0) & 3) != 1 ||	/* ReceiveMode */
-                            !s->rxlen)
-                return;
-            if (!(s->control & (1 << 7)))	/* RxTimeOutEnable */
-                return;
-            /* When the Rx FIFO trigger level is not reached, the interrupt
-             * is generated anyway, just after a small timeout instead of
-             * immediately.  */
-        }
+    if (!s3c_uart_rx_ready(s))
+        return;
 
-    switch ((s->control >> 0) & 3) {		/* ReceiveMode */
-    case 1:
+    if (((s->control >> 0) & 3) == 1)		/* ReceiveMode */
         if ((s->control & (1 << 8)) || pulse)	/* RxInterruptType */
             qemu_irq_raise(s->irq[0]);
-        break;
-    case 2:
-    case 3:
-        qemu_irq_raise(s->dma[0]);
-        break;
-    }
 }
 
 inline static void s3c_uart_empty(struct s3c_uart_state_s *s, int pulse)
 {
-    switch ((s->control >> 2) & 3) {		/* TransmitMode */
-    case 1:
+    if (((s->control >> 2) & 3) == 1)		/* TransmitMode */
         if ((s->control & (1 << 9)) || pulse)	/* TxInterruptType */
             qemu_irq_raise(s->irq[1]);
-        break;
-    case 2:
-    case 3:
-        qemu_irq_raise(s->dma[0]);
-        break;
-    }
 }
 
 inline static void s3c_uart_update(struct s3c_uart_state_s *s)
 {
     s3c_uart_empty(s, 0);
     s3c_uart_full(s, 0);
+    s3c_uart_dma_update(s);
+}
+
+/* Time it takes to shift one character frame in at the current rate */
+static int64_t s3c_uart_char_time(struct s3c_uart_state_s *s)
+{
+    int bits = 1 + 5 + (s->lcontrol & 3) +	/* Start + WordLength */
+            ((s->lcontrol >> 5) & 1) +		/* Parity */
+            ((s->lcontrol & (1 << 2)) ? 2 : 1);	/* StopBit */
+    uint32_t speed = (s->freq->pclk >> 4) / (s->brdiv + 1);
+
+    return muldiv64(bits, ticks_per_sec, speed ?: 1);
+}
+
+/*
+ * The Rx timeout condition occurs when the FIFO holds data below the
+ * trigger level and nothing was received during 3 character times.
+ * The timer is restarted on every character that enters the FIFO.
+ */
+static void s3c_uart_rx_arm(struct s3c_uart_state_s *s)
+{
+    if (!s->rxlen) {
+        s->rxtimeout = 0;
+        qemu_del_timer(s->rxtimer);
+    } else if ((s->fcontrol & 1) &&			/* FIFOEnable */
+                    (s->control & (1 << 7)) &&		/* RxTimeOutEnable */
+                    !s3c_uart_rx_ready(s) &&
+                    s3c_clk_on(s->freq, s->clk))
+        qemu_mod_timer(s->rxtimer, qemu_get_clock(vm_clock) +
+                        3 * s3c_uart_char_time(s));
+}
+
+static void s3c_uart_gate(void *opaque, int on)
+{
+    struct s3c_uart_state_s *s = (struct s3c_uart_state_s *) opaque;
+
+    if (on)
+        s3c_uart_rx_arm(s);
+    else
+        qemu_del_timer(s->rxtimer);
+}
+
+static void s3c_uart_rx_timeout(void *opaque)
+{
+    struct s3c_uart_state_s *s = (struct s3c_uart_state_s *) opaque;
+    if (!s->rxlen)
+        return;
+
+    s->rxtimeout = 1;
+    s3c_uart_full(s, 1);
+    s3c_uart_dma_update(s);
+}
+
+/* Moves characters from the host-side ring into the Rx FIFO */
+static int s3c_uart_refill(struct s3c_uart_state_s *s)
+{
+    int depth = (s->fcontrol & 1) ? 16 : 1;	/* FIFOEnable */
+    int moved = 0;
+
+    while (s->ringlen && s->rxlen < depth) {
+        if (s->fcontrol & 1)
+            s->rxfifo[(s->rxstart + s->rxlen) & 15] = s->ring[s->ringstart];
+        else
+            s->data = s->ring[s->ringstart];
+        s->rxlen ++;
+        s->ringstart = (s->ringstart + 1) % s->ringsize;
+        s->ringlen --;
+        moved ++;
+    }
+    return moved;
 }
 
 static void s3c_uart_params_update(struct s3c_uart_state_s *s)
@@ -1321,9 +1863,22 @@ static void s3c_uart_params_update(struct s3c_uart_state_s *s)
         qemu_chr_ioctl(s->chr[i], CHR_IOCTL_SERIAL_SET_PARAMS, &ssp);
 }
 
+/* Baud rate and Rx timeout follow PCLK */
+static void s3c_uart_rate(void *opaque, int changed)
+{
+    struct s3c_uart_state_s *s = (struct s3c_uart_state_s *) opaque;
+
+    if (!changed)
+        return;
+    s3c_uart_params_update(s);
+    s3c_uart_rx_arm(s);
+}
+
 static int s3c_uart_is_empty(void *opaque)
 {
     struct s3c_uart_state_s *s = (struct s3c_uart_state_s *) opaque;
+    if (s->ringsize)
+        return s->ringsize - s->ringlen;
     if (s->fcontrol & 1)			/* FIFOEnable */
         return 16 - s->rxlen;
     else
@@ -1334,7 +1889,24 @@ static void s3c_uart_rx(void *opaque, const uint8_t *buf, int size)
 {
     struct s3c_uart_state_s *s = (struct s3c_uart_state_s *) opaque;
     int left;
-    if (s->fcontrol & 1) {			/* FIFOEnable */
+    if (s->ringsize) {
+        if (s->ringlen + size > s->ringsize) {
+            size = s->ringsize - s->ringlen;
+            s3c_uart_err(s, 1);
+        }
+
+        left = s->ringsize - ((s->ringstart + s->ringlen) % s->ringsize);
+        if (size > left) {
+            memcpy(s->ring + s->ringsize - left, buf, left);
+            memcpy(s->ring, buf + left, size - left);
+        } else
+            memcpy(s->ring + (s->ringstart + s->ringlen) % s->ringsize,
+                            buf, size);
+        s->ringlen += size;
+
+        if (!s3c_uart_refill(s))
+            return;
+    } else if (s->fcontrol & 1) {		/* FIFOEnable */
         if (s->rxlen + size > 16) {
             size = 16 - s->rxlen;
             s3c_uart_err(s, 1);
@@ -1353,7 +1925,9 @@ static void s3c_uart_rx(void *opaque, const uint8_t *buf, int size)
         s->rxlen = 1;
         s->data = buf[0];
     }
+    s3c_uart_rx_arm(s);
     s3c_uart_full(s, 1);
+    s3c_uart_dma_update(s);
 }
 
 /* S3C2410 UART doesn't seem to understand break conditions.  */
@@ -1412,6 +1986,9 @@ static uint32_t s3c_uart_read(void *opaque, target_phys_addr_t addr)
                 s->rxstart &= 15;
             } else
                 ret = s->data;
+            s3c_uart_refill(s);
+            s3c_uart_rx_arm(s);
+            s3c_uart_dma_update(s);
             return ret;
         }
         return 0;
@@ -1446,12 +2023,15 @@ static void s3c_uart_write(void *opaque, target_phys_addr_t addr,
             printf("%s: UART loopback test mode %s\n", __FUNCTION__,
                             (value & (1 << 5)) ? "on" : "off");
         s->control = value & 0x7ef;
+        s3c_uart_rx_arm(s);
         s3c_uart_update(s);
         break;
     case S3C_UFCON:
         if (value & (1 << 1))			/* RxReset */
             s->rxlen = 0;
         s->fcontrol = value & 0xf1;
+        s3c_uart_refill(s);
+        s3c_uart_rx_arm(s);
         s3c_uart_update(s);
         break;
     case S3C_UMCON:
@@ -1497,6 +2077,7 @@ static CPUWriteMemoryFunc *s3c_uart_writefn[] = {
 static void s3c_uart_save(QEMUFile *f, void *opaque)
 {
     struct s3c_uart_state_s *s = (struct s3c_uart_state_s *) opaque;
+    int i;
     qemu_put_8s(f, &s->data);
     qemu_put_buffer(f, s->rxfifo, sizeof(s->rxfifo));
     qemu_put_be32(f, s->rxstart);
@@ -1507,11 +2088,18 @@ static void s3c_uart_save(QEMUFile *f, void *opaque)
     qemu_put_be16s(f, &s->control);
     qemu_put_be16s(f, &s->brdiv);
     qemu_put_8s(f, &s->errstat);
+    qemu_put_be32(f, s->rxtimeout);
+    qemu_put_timer(f, s->rxtimer);
+    qemu_put_be32(f, s->ringlen);
+    for (i = 0; i < s->ringlen; i ++)
+        qemu_put_8s(f, &s->ring[(s->ringstart + i) % s->ringsize]);
 }
 
 static int s3c_uart_load(QEMUFile *f, void *opaque, int version_id)
 {
     struct s3c_uart_state_s *s = (struct s3c_uart_state_s *) opaque;
+    uint8_t ch;
+    int i, len;
     qemu_get_8s(f, &s->data);
     qemu_get_buffer(f, s->rxfifo, sizeof(s->rxfifo));
     s->rxstart = qemu_get_be32(f);
@@ -1523,6 +2111,19 @@ static int s3c_uart_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_be16s(f, &s->brdiv);
     qemu_get_8s(f, &s->errstat);
 
+    s->ringstart = 0;
+    s->ringlen = 0;
+    if (version_id >= 1) {
+        s->rxtimeout = qemu_get_be32(f);
+        qemu_get_timer(f, s->rxtimer);
+        len = qemu_get_be32(f);
+        for (i = 0; i < len; i ++) {
+            qemu_get_8s(f, &ch);
+            if (s->ringlen < s->ringsize)
+                s->ring[s->ringlen ++] = ch;
+        }
+    }
+
     return 0;
 }
 
@@ -1537,6 +2138,11 @@ struct s3c_uart_state_s *s3c_uart_init(struct s3c_freq_s * freq, target_phys_add
     s->base = base;
     s->irq = irqs;
     s->dma = dma;
+    s->rxtimer = qemu_new_timer(vm_clock, s3c_uart_rx_timeout, s);
+    s3c_uart_set_ring(s, S3C_UART_RING);
+    s->clk = S3C_CLK_UART0 + ((base >> 14) & 3);
+    s3c_clk_gate_add(freq, s->clk, s3c_uart_gate, s);
+    s3c_clk_notify_add(freq, s3c_uart_rate, s);
 
     s3c_uart_reset(s);
 
@@ -1544,11 +2150,21 @@ struct s3c_uart_state_s *s3c_uart_init(struct s3c_freq_s * freq, target_phys_add
                     s3c_uart_writefn, s);
     cpu_register_physical_memory(s->base, 0xfff, iomemtype);
 
-    register_savevm("s3c24xx_uart", base, 0, s3c_uart_save, s3c_uart_load, s);
+    register_savevm("s3c24xx_uart", base, 1, s3c_uart_save, s3c_uart_load, s);
 
     return s;
 }
 
+/* A SIZE of zero feeds the FIFO directly, dropping what doesn't fit */
+void s3c_uart_set_ring(struct s3c_uart_state_s *s, int size)
+{
+    qemu_free(s->ring);
+    s->ring = size ? qemu_malloc(size) : NULL;
+    s->ringsize = size;
+    s->ringstart = 0;
+    s->ringlen = 0;
+}
+
 void s3c_uart_attach(struct s3c_uart_state_s *s, CharDriverState *chr)
 {
     if (s->chr_num >= UART_MAX_CHR)
@@ -1560,21 +2176,33 @@ void s3c_uart_attach(struct s3c_uart_state_s *s, CharDriverState *chr)
 }
 
 /* ADC & Touchscreen interface */
+#define S3C_ADC_RING	256	/* Host pen events not yet seen by the guest */
+
 struct s3c_adc_state_s {
+    struct s3c_freq_s *freq;
     target_phys_addr_t base;
     qemu_irq irq;
     qemu_irq tcirq;
     QEMUTimer *convt;
-    QEMUTimer *tst;
     int x;
     int y;
     int down;
     int enable;
+    int converting;
     int input[8];
     int in_idx;
     int noise;
     int scale[6];
 
+    /* Pen events are handed to the guest one sample at a time */
+    struct {
+        int x;
+        int y;
+        int down;
+    } ring[S3C_ADC_RING];
+    int ringstart;
+    int ringlen;
+
     uint16_t control;
     uint16_t ts;
     uint16_t delay;
@@ -1589,57 +2217,118 @@ static void s3c_adc_reset(struct s3c_adc_state_s *s)
     s->ts = 0x58;
     s->delay = 0xff;
     s->enable = 1;
+    s->converting = 0;
+    s->ringlen = 0;
+    qemu_del_timer(s->convt);
+}
+
+/* Makes the oldest queued pen event the current pen state */
+static int s3c_adc_next(struct s3c_adc_state_s *s)
+{
+    if (!s->ringlen)
+        return 0;
+
+    s->x = s->ring[s->ringstart].x;
+    s->y = s->ring[s->ringstart].y;
+    s->down = s->ring[s->ringstart].down;
+    s->ringstart = (s->ringstart + 1) % S3C_ADC_RING;
+    s->ringlen --;
+    return 1;
+}
+
+/*
+ * In the Waiting for Interrupt mode (XY_PST = 3) INT_TC is raised when
+ * the pen goes down, or up if UD_SEN is set.  While waiting for the
+ * pen to go up, moves stay queued for the conversions that follow.
+ */
+static void s3c_adc_wait(struct s3c_adc_state_s *s)
+{
+    int up = (s->ts >> 8) & 1;				/* UD_SEN */
+
+    if ((s->ts & 3) != 3 || !s->enable)
+        return;
+
+    if (up) {
+        if (s->down && s->ringlen && !s->ring[s->ringstart].down)
+            s3c_adc_next(s);
+        if (!s->down)
+            qemu_irq_raise(s->tcirq);
+    } else {
+        while (!s->down && s3c_adc_next(s));
+        if (s->down)
+            qemu_irq_raise(s->tcirq);
+    }
+}
+
+/* A conversion takes 5 ADC clocks, each touchscreen axis conversion
+ * is also preceded by ADCDLY X-tal clocks.  */
+static int64_t s3c_adc_time(struct s3c_adc_state_s *s)
+{
+    int prescaler = (s->control & (1 << 14)) ?		/* PRSCEN */
+            ((s->control >> 6) & 0xff) + 1 : 1;
+    int64_t conv = muldiv64(5 * prescaler, ticks_per_sec, s->freq->pclk);
+    int64_t delay = muldiv64(s->delay, ticks_per_sec, s->freq->xtal);
+
+    if (s->ts & (1 << 2))				/* AUTO_PST */
+        return 2 * (delay + conv);
+    if (s->ts & 3)					/* XY_PST */
+        return delay + conv;
+    return conv;
 }
 
 static void s3c_adc_start(struct s3c_adc_state_s *s)
 {
-    if (!s->enable || (s->ts & 7) == 0)
+    if (!s->enable)
         return;
     s->control &= ~(1 << 15);
     s->in_idx = (s->control >> 3) & 7;
-    qemu_mod_timer(s->convt, qemu_get_clock(vm_clock) + (ticks_per_sec >> 5));
+    s->converting = 1;
+    if (s3c_clk_on(s->freq, S3C_CLK_ADC))
+        qemu_mod_timer(s->convt, qemu_get_clock(vm_clock) + s3c_adc_time(s));
 }
 
 static void s3c_adc_done(void *opaque)
 {
     struct s3c_adc_state_s *s = (struct s3c_adc_state_s *) opaque;
-    s->xdata = s->input[s->in_idx] & 0x3ff;
+    int sx, sy, auto_pst = (s->ts >> 2) & 1, xy_pst = s->ts & 3;
+    uint16_t flags = (auto_pst << 14) | (xy_pst << 12);
+
+    s->converting = 0;
+    if (auto_pst || xy_pst == 1 || xy_pst == 2) {
+        sx = s->x * s->scale[0] + s->y * s->scale[1] + s->scale[2];
+        sy = s->x * s->scale[3] + s->y * s->scale[4] + s->scale[5];
+        if (auto_pst || xy_pst == 1)
+            s->xdata = (((sx >> 13) & 0xfff) ^ (s->noise >> 1)) | flags;
+        if (auto_pst || xy_pst == 2)
+            s->ydata = (((sy >> 13) & 0xfff) ^ (s->noise >> 2)) | flags;
+        s->noise ++;
+        s->noise &= 7;
+
+        /* The next sample sees the next pen event */
+        s3c_adc_next(s);
+    } else
+        s->xdata = s->input[s->in_idx] & 0x3ff;
+
     s->control |= 1 << 15;
     qemu_irq_raise(s->irq);
 }
 
-static void s3c_adc_tick(void *opaque)
-{
-    struct s3c_adc_state_s *s = (struct s3c_adc_state_s *) opaque;
-    int sx, sy;
-
-    if (s->down) {
-        if ((s->ts & 3) == 3 && s->enable)
-            qemu_irq_raise(s->tcirq);
-        else if (s->enable && ((s->ts & (1 << 2)) || (s->ts & 3))) {
-            sx = s->x * s->scale[0] + s->y * s->scale[1] + s->scale[2];
-            sy = s->x * s->scale[3] + s->y * s->scale[4] + s->scale[5];
-            s->xdata = ((sx >> 13) & 0xfff) | (1 << 14) | ((s->ts & 3) << 12);
-            s->ydata = ((sy >> 13) & 0xfff) | (1 << 14) | ((s->ts & 3) << 12);
-            s->xdata ^= s->noise >> 1;
-            s->ydata ^= s->noise >> 2;
-            qemu_irq_raise(s->irq);
-            s->noise ++;
-            s->noise &= 7;
-        }
-        qemu_mod_timer(s->tst, qemu_get_clock(vm_clock) +
-                        (ticks_per_sec >> 5));
-    }
-}
-
 static void s3c_adc_event(void *opaque,
                 int x, int y, int z, int buttons_state)
 {
     struct s3c_adc_state_s *s = (struct s3c_adc_state_s *) opaque;
-    s->down = !!buttons_state;
-    s->x = x;
-    s->y = y;
-    s3c_adc_tick(s);
+    int i;
+
+    if (s->ringlen < S3C_ADC_RING)
+        i = (s->ringstart + s->ringlen ++) % S3C_ADC_RING;
+    else
+        /* Full, the newest event replaces the last queued one */
+        i = (s->ringstart + s->ringlen - 1) % S3C_ADC_RING;
+    s->ring[i].x = x;
+    s->ring[i].y = y;
+    s->ring[i].down = !!buttons_state;
+
+    s3c_adc_wait(s);
 }
 
 #define S3C_ADCCON	0x00	/* ADC Control register */
@@ -1651,6 +2340,7 @@ static void s3c_adc_event(void *opaque,
 static uint32_t s3c_adc_read(void *opaque, target_phys_addr_t addr)
 {
     struct s3c_adc_state_s *s = (struct s3c_adc_state_s *) opaque;
+    uint32_t ret;
 
     switch (addr) {
     case S3C_ADCCON:
@@ -1660,11 +2350,12 @@ static uint32_t s3c_adc_read(void *opaque, target_phys_addr_t addr)
     case S3C_ADCDLY:
         return s->delay;
     case S3C_ADCDAT0:
-        if (s->control & 2)
+        ret = ((!s->down) << 15) | (uint16_t) s->xdata;
+        if (s->control & 2)				/* READ_START */
             s3c_adc_start(s);
-        return ((!s->down) << 15) | s->xdata;
+        return ret;
     case S3C_ADCDAT1:
-        return ((!s->down) << 15) | s->ydata;
+        return ((!s->down) << 15) | (uint16_t) s->ydata;
     default:
         printf("%s: Bad register 0x%lx\n", __FUNCTION__, (unsigned long)addr);
         break;
@@ -1681,15 +2372,16 @@ static void s3c_adc_write(void *opaque, target_phys_addr_t addr,
     case S3C_ADCCON:
         s->control = (s->control & 0x8000) | (value & 0x7ffe);
         s->enable = !(value & 4);
-        if ((value & 1) && !(value & 2))
-            s3c_adc_start(s);
-        if (!s->enable)
+        if (!s->enable) {
+            s->converting = 0;
             qemu_del_timer(s->convt);
-        s3c_adc_tick(s);
+        } else if ((value & 1) && !(value & 2))
+            s3c_adc_start(s);
         break;
 
     case S3C_ADCTSC:
-        s->ts = value & 0xff;
+        s->ts = value & 0x1ff;
+        s3c_adc_wait(s);
         break;
 
     case S3C_ADCDLY:
@@ -1716,7 +2408,7 @@ static CPUWriteMemoryFunc *s3c_adc_writefn[] = {
 static void s3c_adc_save(QEMUFile *f, void *opaque)
 {
     struct s3c_adc_state_s *s = (struct s3c_adc_state_s *) opaque;
-    int i;
+    int i, j;
     qemu_put_be32(f, s->enable);
     for (i = 0; i < 8; i ++)
         qemu_put_be32(f, s->input[i]);
@@ -1728,6 +2420,20 @@ static void s3c_adc_save(QEMUFile *f, void *opaque)
     qemu_put_be16s(f, &s->delay);
     qemu_put_sbe16s(f, &s->xdata);
     qemu_put_sbe16s(f, &s->ydata);
+
+    qemu_put_be32(f, s->x);
+    qemu_put_be32(f, s->y);
+    qemu_put_be32(f, s->down);
+    qemu_put_be32(f, s->converting);
+    qemu_put_timer(f, s->convt);
+
+    qemu_put_be32(f, s->ringlen);
+    for (i = 0; i < s->ringlen; i ++) {
+        j = (s->ringstart + i) % S3C_ADC_RING;
+        qemu_put_be32(f, s->ring[j].x);
+        qemu_put_be32(f, s->ring[j].y);
+        qemu_put_be32(f, s->ring[j].down);
+    }
 }
 
 static int s3c_adc_load(QEMUFile *f, void *opaque, int version_id)
@@ -1746,24 +2452,58 @@ static int s3c_adc_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_sbe16s(f, &s->xdata);
     qemu_get_sbe16s(f, &s->ydata);
 
-    if (s->enable && (s->ts & 7) && !(s->control & (1 << 15)))
+    if (version_id >= 1) {
+        s->x = qemu_get_be32(f);
+        s->y = qemu_get_be32(f);
+        s->down = qemu_get_be32(f);
+        s->converting = qemu_get_be32(f);
+        qemu_get_timer(f, s->convt);
+    } else if (s->enable && !(s->control & (1 << 15)))
         s3c_adc_start(s);
 
+    /* Pen events the guest hasn't seen yet */
+    s->ringstart = 0;
+    s->ringlen = 0;
+    if (version_id >= 2) {
+        s->ringlen = qemu_get_be32(f);
+        if (s->ringlen < 0 || s->ringlen > S3C_ADC_RING) {
+            s->ringlen = 0;
+            return -EINVAL;
+        }
+        for (i = 0; i < s->ringlen; i ++) {
+            s->ring[i].x = qemu_get_be32(f);
+            s->ring[i].y = qemu_get_be32(f);
+            s->ring[i].down = qemu_get_be32(f);
+        }
+    }
+
     return 0;
 }
 
-struct s3c_adc_state_s *s3c_adc_init(target_phys_addr_t base, qemu_irq irq,
-                qemu_irq tcirq)
+/* A conversion in progress restarts when the clock comes back */
+static void s3c_adc_gate(void *opaque, int on)
+{
+    struct s3c_adc_state_s *s = (struct s3c_adc_state_s *) opaque;
+
+    if (!on)
+        qemu_del_timer(s->convt);
+    else if (s->converting)
+        s3c_adc_start(s);
+}
+
+struct s3c_adc_state_s *s3c_adc_init(struct s3c_freq_s *freq,
+                target_phys_addr_t base, qemu_irq irq, qemu_irq tcirq)
 {
     int iomemtype;
     struct s3c_adc_state_s *s = (struct s3c_adc_state_s *)
             qemu_mallocz(sizeof(struct s3c_adc_state_s));
 
+    s->freq = freq;
     s->base = base;
     s->irq = irq;
     s->tcirq = tcirq;
     s->convt = qemu_new_timer(vm_clock, s3c_adc_done, s);
-    s->tst = qemu_new_timer(vm_clock, s3c_adc_tick, s);
+    s3c_clk_gate_add(freq, S3C_CLK_ADC, s3c_adc_gate, s);
 
     s3c_adc_reset(s);
 
@@ -1775,7 +2515,7 @@ struct s3c_adc_state_s *s3c_adc_init(target_phys_addr_t base, qemu_irq irq,
     qemu_add_mouse_event_handler(s3c_adc_event, s, 1,
                     "QEMU S3C2410-driven Touchscreen");
 
-    register_savevm("s3c24xx_adc", 0, 0, s3c_adc_save, s3c_adc_load, s);
+    register_savevm("s3c24xx_adc", 0, 2, s3c_adc_save, s3c_adc_load, s);
 
     return s;
 }
@@ -2591,6 +3331,17 @@ static void s3c_wdt_reset(struct s3c_wdt_state_s *s)
     s3c_wdt_start(s);
 }
 
+/* The count is brought up to date at the old PCLK rate */
+static void s3c_wdt_rate(void *opaque, int changed)
+{
+    struct s3c_wdt_state_s *s = (struct s3c_wdt_state_s *) opaque;
+
+    if (changed)
+        s3c_wdt_start(s);
+    else if (s->control & (1 << 5))
+        s3c_wdt_stop(s);
+}
+
 static void s3c_wdt_timeout(void *opaque)
 {
     struct s3c_wdt_state_s *s = (struct s3c_wdt_state_s *) opaque;
@@ -2696,6 +3447,7 @@ struct s3c_wdt_state_s *s3c_wdt_init(struct s3c_freq_s * freq, target_phys_addr_
     s->base = base;
     s->irq = irq;
     s->tm = qemu_new_timer(vm_clock, s3c_wdt_timeout, s);
+    s3c_clk_notify_add(freq, s3c_wdt_rate, s);
 
     s3c_wdt_reset(s);
 
@@ -2751,6 +3503,7 @@ static void s3c2410_reset(void *opaque)
     s3c_spi_reset(s->spi);
     s3c_udc_reset(s->udc);
     s3c_wdt_reset(s->wdt);
+    s->sleeping = 0;
     s3c_clkpwr_reset(s);
     s->nand->reset(s->nand);
     for (i = 0; s3c2410_uart[i].base; i ++)
@@ -2801,8 +3554,9 @@ struct s3c_state_s *s3c24xx_init(
 
     s->pic = s3c_pic_init(0x4a000000, arm_pic_init_cpu(s->env));
     s->irq = s3c_pic_get(s->pic);
+    s->wake = qemu_allocate_irqs(s3c_wakeup, s, 1);
 
-    s->dma = s3c_dma_init(0x4b000000, &s->irq[S3C_PIC_DMA0]);
+    s->dma = s3c_dma_init(&s->clock, 0x4b000000, &s->irq[S3C_PIC_DMA0]);
     s->drq = s3c_dma_get(s->dma);
 
     s->clkpwr_base = 0x4c000000;
@@ -2811,7 +3565,7 @@ struct s3c_state_s *s3c24xx_init(
     iomemtype = cpu_register_io_memory(0, s3c_clkpwr_readfn,
                     s3c_clkpwr_writefn, s);
     cpu_register_physical_memory(s->clkpwr_base, 0xffffff, iomemtype);
-    register_savevm("s3c24xx_clkpwr", 0, 0,
+    register_savevm("s3c24xx_clkpwr", 0, 1,
                     s3c_clkpwr_save, s3c_clkpwr_load, s);
 
     s->lcd = s3c_lcd_init(0x4d000000, s->irq[S3C_PIC_LCD]);
@@ -2830,9 +3584,9 @@ struct s3c_state_s *s3c24xx_init(
             s3c_uart_attach(s->uart[i], serial_hds[i]);
     }
 
-    s->timers = s3c_timers_init(&s->clock, 0x51000000, &s->irq[S3C_PIC_TIMER0], s->drq);
+    s->timers = s3c_timers_init(&s->clock, 0x51000000, s->pic, s->drq);
 
-    s->udc = s3c_udc_init(0x52000000, s->irq[S3C_PIC_USBD], s->drq);
+    s->udc = s3c_udc_init(0x52000000, s->irq[S3C_PIC_USBD], s->drq, s->dma);
 
     s->wdt = s3c_wdt_init(&s->clock, 0x53000000, s->irq[S3C_PIC_WDT]);
 
@@ -2848,9 +3602,9 @@ struct s3c_state_s *s3c24xx_init(
 
     s->io = s3c_gpio_init(0x56000000, s->irq, s->cpu_id);
 
-    s->rtc = s3c_rtc_init(0x57000000, s->irq[S3C_PIC_RTC]);
+    s->rtc = s3c_rtc_init(0x57000000, s->pic);
 
-    s->adc = s3c_adc_init(0x58000000, s->irq[S3C_PICS_ADC],
+    s->adc = s3c_adc_init(&s->clock, 0x58000000, s->irq[S3C_PICS_ADC],
                     s->irq[S3C_PICS_TC]);
 
     s->spi = s3c_spi_init(0x59000000,
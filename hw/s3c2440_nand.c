@@ -24,8 +24,16 @@ struct s3c2440_nand_s {
     uint32_t nfaddr;
     ECCState nfecc;
     ECCState nfsecc;	/* spare area */
+    ECCBCHState nfbch;	/* main area, 4/8 bit BCH mode */
     int nfwp;
 
+    /* Data not yet run through the ECC generators, digested in one go
+     * when an ECC register is read or the buffer fills up.  */
+    uint8_t mecc_buf[2048];
+    int mecc_len;
+    uint8_t secc_buf[64];
+    int secc_len;
+
     uint32_t nfaddr_cur;
     uint32_t nfsblk;
     uint32_t nfeblk;
@@ -67,6 +75,11 @@ extern struct s3c_state_s *g_s3c;
 #define S3C_NFSBLK		0x38	/* NAND flash programmable start block address (unimplemented)*/
 #define S3C_NFEBLK		0x3c	/* NAND flash programmable end block address (unimplemented)*/
 
+/* Not in the S3C2440, BCH generator for kernels using 4/8 bit ECC */
+#define S3C_NF8ECCCONF	0x40	/* BCH correctable bits: 0 (off), 4 or 8 */
+#define S3C_NF8MECC0	0x44	/* BCH parity bytes 0-3 */
+#define S3C_NF8MECC3	0x50	/* BCH parity bytes 12-15 */
+
 static void s3c2440_nand_reset(void * opaque)
 {
 	struct s3c2440_nand_s *s = (struct s3c2440_nand_s *)opaque;
@@ -83,10 +96,88 @@ static void s3c2440_nand_reset(void * opaque)
     s->nfeblk = 0;
     ecc_reset(&s->nfecc);
     ecc_reset(&s->nfsecc);
+    ecc_bch_reset(&s->nfbch, 0);
+    s->mecc_len = 0;
+    s->secc_len = 0;
 }
 
 static uint8_t dbu[16],cmd;
 
+static void s3c2440_nand_ecc_flush(struct s3c2440_nand_s *s)
+{
+    if (s->mecc_len) {
+        ecc_digest_block(&s->nfecc, s->mecc_buf, s->mecc_len);
+        ecc_bch_digest_block(&s->nfbch, s->mecc_buf, s->mecc_len);
+        s->mecc_len = 0;
+    }
+    if (s->secc_len) {
+        ecc_digest_block(&s->nfsecc, s->secc_buf, s->secc_len);
+        s->secc_len = 0;
+    }
+}
+
+/* Queue LEN bytes starting at nfaddr_cur for the main/spare area ECC.  */
+static void s3c2440_nand_ecc(struct s3c2440_nand_s *s,
+                const uint8_t *buf, int len)
+{
+    int n = 0;
+
+    if (s->nfaddr_cur < 512) {
+        n = MIN(len, 512 - s->nfaddr_cur);
+        if (!(s->nfcont & S3C_NFCONT_MECCL)) {
+            if (s->mecc_len + n > sizeof(s->mecc_buf))
+                s3c2440_nand_ecc_flush(s);
+            memcpy(s->mecc_buf + s->mecc_len, buf, n);
+            s->mecc_len += n;
+        }
+    }
+    if (len > n && !(s->nfcont & S3C_NFCONT_SECCL)) {
+        if (s->secc_len + len - n > sizeof(s->secc_buf))
+            s3c2440_nand_ecc_flush(s);
+        memcpy(s->secc_buf + s->secc_len, buf + n, len - n);
+        s->secc_len += len - n;
+    }
+
+    if (s->nfaddr_cur < 16)
+        memcpy(dbu + s->nfaddr_cur, buf, MIN(len, 16 - s->nfaddr_cur));
+    s->nfaddr_cur += len;
+}
+
+/* Hamming ECC as laid out in the NFMECC/NFSECC registers */
+static uint32_t s3c2440_nand_ecc_reg(ECCState *ecc)
+{
+#define ECC(shr, b, shl)	((ecc->lp[b] << (shl - shr)) & (1 << shl))
+    return ~(
+        ECC(0, 1, 0)	| ECC(0, 0, 1)	| ECC(1, 1, 2)	| ECC(1, 0, 3)	| ECC(2, 1, 4)	| ECC(2, 0, 5)	| ECC(3, 1, 6)	| ECC(3, 0, 7)	|
+        ECC(4, 1, 8)	| ECC(4, 0, 9)	| ECC(5, 1, 10)	| ECC(5, 0, 11)	| ECC(6, 1, 12)	| ECC(6, 0, 13)	| ECC(7, 1, 14)	| ECC(7, 0, 15)	|
+        ECC(8, 1, 16)	| ECC(8, 0, 17)	| ((ecc->cp & 0x3f) << 18) |
+        ECC(9, 1, 28)	| ECC(9, 0, 29)	| ECC(10, 1, 30)	| ECC(10, 0, 31)
+        );
+#undef ECC
+}
+
+/* NFDATA accesses, LEN is the access width.  */
+static void s3c2440_nand_data_in(struct s3c2440_nand_s *s,
+                uint8_t *buf, int len)
+{
+    nand_getio_block(s->nand, buf, len);
+    s3c2440_nand_ecc(s, buf, len);
+}
+
+static void s3c2440_nand_data_out(struct s3c2440_nand_s *s,
+                const uint8_t *buf, int len)
+{
+    if (s->nfcont & S3C_NFCONT_LOCK) {
+        if (s->nfaddr_cur < (s->nfsblk << 6) ||
+                s->nfaddr_cur > (s->nfeblk << 6)) {
+            /* TODO: ADD IRQ */
+            return;
+        }
+    }
+    s3c2440_nand_ecc(s, buf, len);
+    nand_setio_block(s->nand, buf, len);
+}
+
 static uint32_t s3c2440_nand_read(void *opaque, target_phys_addr_t addr)
 {
     struct s3c2440_nand_s *s = (struct s3c2440_nand_s *) opaque;
@@ -105,19 +196,9 @@ static uint32_t s3c2440_nand_read(void *opaque, target_phys_addr_t addr)
         return s->nfaddr >> 24; // last 8 bits poked
     case S3C_NFDATA:
         if (s->nfcont & S3C_NFCONT_MODE) {
-            uint32_t value = nand_getio(s->nand);
-
-        	if (s->nfaddr_cur < 512) {
-        		if (!(s->nfcont & S3C_NFCONT_MECCL)) {
-        			value = ecc_digest(&s->nfecc, value & 0xff);
-        		/*	printf("ecc %02x -> %08x %08x cp %08x cnt %d\n", value, s->nfecc.lp[0], s->nfecc.lp[1], s->nfecc.cp, s->nfecc.count); */
-        		}
-        	} else {
-        		if (!(s->nfcont & S3C_NFCONT_SECCL))
-        			value = ecc_digest(&s->nfsecc, value & 0xff);
-        	}
-        	if (s->nfaddr_cur < 16) dbu[s->nfaddr_cur] = value;
-        	s->nfaddr_cur++;
+            uint8_t value;
+
+            s3c2440_nand_data_in(s, &value, 1);
             return value;
         }
         break;
@@ -127,18 +208,9 @@ static uint32_t s3c2440_nand_read(void *opaque, target_phys_addr_t addr)
     case S3C_NFMECCD0 + 3: shr += 8;
     case S3C_NFMECCD0 + 2: shr += 8;
     case S3C_NFMECCD0 + 1: shr += 8;
-    case S3C_NFMECCD0: {
-#define ECC(shr, b, shl)	((s->nfecc.lp[b] << (shl - shr)) & (1 << shl))
-        uint32 ecc = ~(
-            ECC(0, 1, 0)	| ECC(0, 0, 1)	| ECC(1, 1, 2)	| ECC(1, 0, 3)	| ECC(2, 1, 4)	| ECC(2, 0, 5)	| ECC(3, 1, 6)	| ECC(3, 0, 7)	|
-            ECC(4, 1, 8)	| ECC(4, 0, 9)	| ECC(5, 1, 10)	| ECC(5, 0, 11)	| ECC(6, 1, 12)	| ECC(6, 0, 13)	| ECC(7, 1, 14)	| ECC(7, 0, 15)	|
-            ECC(8, 1, 16)	| ECC(8, 0, 17)	| ((s->nfecc.cp & 0x3f) << 18) |
-            ECC(9, 1, 28)	| ECC(9, 0, 29)	| ECC(10, 1, 30)	| ECC(10, 0, 31)
-            );
-      /*  printf("Read ECC %02x = %08x >> %d [ 0: %08x 1: %08x cnt %d ]\n", addr, ecc, shr, s->nfecc.lp[0], s->nfecc.lp[1], s->nfecc.count); */
-		ecc = (ecc >> shr) & 0xff;
-        return ecc;
-    }	break;
+    case S3C_NFMECCD0:
+        s3c2440_nand_ecc_flush(s);
+        return (s3c2440_nand_ecc_reg(&s->nfecc) >> shr) & 0xff;
     case S3C_NFMECCD1 + 3:
     case S3C_NFMECCD1 + 2:
     case S3C_NFMECCD1 + 1:
@@ -146,21 +218,31 @@ static uint32_t s3c2440_nand_read(void *opaque, target_phys_addr_t addr)
     	/* the ecc digester is limited to 2, the s3c2440 can do 4... */
         printf("%s: Bad register S3C_NFECCD1 NOT HANDLED\n", __FUNCTION__);
     	break;
-#undef ECC
 
     case S3C_NFSECCD + 3: shr += 8;
     case S3C_NFSECCD + 2: shr += 8;
     case S3C_NFSECCD + 1: shr += 8;
     case S3C_NFSECCD:
-#define ECC(shr, b, shl)	((s->nfsecc.lp[b] << (shl - shr)) & (1 << shl))
-        return (~(
-            ECC(0, 1, 0)	| ECC(0, 0, 1)	| ECC(1, 1, 2)	| ECC(1, 0, 3)	| ECC(2, 1, 4)	| ECC(2, 0, 5)	| ECC(3, 1, 6)	| ECC(3, 0, 7)	|
-            ECC(4, 1, 8)	| ECC(4, 0, 9)	| ECC(5, 1, 10)	| ECC(5, 0, 11)	| ECC(6, 1, 12)	| ECC(6, 0, 13)	| ECC(7, 1, 14)	| ECC(7, 0, 15)	|
-            ECC(8, 1, 16)	| ECC(8, 0, 17)	| ((s->nfecc.cp & 0x3f) << 18) |
-            ECC(9, 1, 28)	| ECC(9, 0, 29)	| ECC(10, 1, 30)	| ECC(10, 0, 31)
-            ) >> shr) &
-            0xff;
-#undef ECC
+        s3c2440_nand_ecc_flush(s);
+        return (s3c2440_nand_ecc_reg(&s->nfsecc) >> shr) & 0xff;
+
+    case S3C_NFMECC0:
+        s3c2440_nand_ecc_flush(s);
+        return s3c2440_nand_ecc_reg(&s->nfecc);
+    case S3C_NFSECC:
+        s3c2440_nand_ecc_flush(s);
+        return s3c2440_nand_ecc_reg(&s->nfsecc);
+
+    case S3C_NF8ECCCONF:
+        return s->nfbch.t;
+    case S3C_NF8MECC0 ... S3C_NF8MECC3: {
+        uint8_t code[19] = { 0 };
+        uint8_t *p = code + addr - S3C_NF8MECC0;
+
+        s3c2440_nand_ecc_flush(s);
+        ecc_bch_code(&s->nfbch, code);
+        return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    }
 
     case S3C_NFSBLK:
     	return s->nfsblk;
@@ -180,20 +262,30 @@ static uint32_t s3c2440_nand_read(void *opaque, target_phys_addr_t addr)
  */
 static uint32_t s3c2440_nand_read16(void *opaque, target_phys_addr_t addr)
 {
-	uint32_t res = s3c2440_nand_read(opaque, addr);
-	if (addr == S3C_NFDATA)
-		res = (s3c2440_nand_read(opaque, addr) << 8) | (res & 0xff);
-	return res;
+    struct s3c2440_nand_s *s = (struct s3c2440_nand_s *) opaque;
+    uint8_t buf[2];
+
+    if (addr != S3C_NFDATA)
+        return s3c2440_nand_read(opaque, addr);
+    if (!s->nand || !(s->nfcont & S3C_NFCONT_MODE))
+        return 0;
+
+    s3c2440_nand_data_in(s, buf, 2);
+    return buf[0] | (buf[1] << 8);
 }
 
 static uint32_t s3c2440_nand_read32(void *opaque, target_phys_addr_t addr)
 {
-	uint32_t res = s3c2440_nand_read16(opaque, addr);
+    struct s3c2440_nand_s *s = (struct s3c2440_nand_s *) opaque;
+    uint8_t buf[4];
 
-    if (addr == S3C_NFDATA) {
-		res = (s3c2440_nand_read16(opaque, addr) << 16) | (res & 0xffff);
-    }
-	return res;
+    if (addr != S3C_NFDATA)
+        return s3c2440_nand_read(opaque, addr);
+    if (!s->nand || !(s->nfcont & S3C_NFCONT_MODE))
+        return 0;
+
+    s3c2440_nand_data_in(s, buf, 4);
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
 }
 
 static void s3c2440_nand_write(void *opaque, target_phys_addr_t addr,
@@ -213,6 +305,9 @@ static void s3c2440_nand_write(void *opaque, target_phys_addr_t addr,
         if (value & S3C_NFCONT_INITECC) {
             ecc_reset(&s->nfecc);
             ecc_reset(&s->nfsecc);
+            ecc_bch_reset(&s->nfbch, s->nfbch.t);
+            s->mecc_len = 0;
+            s->secc_len = 0;
         }
         /* tight lock is sticky */
         s->nfcont = (value & (0xffff ^ S3C_NFCONT_INITECC)) | (s->nfcont & S3C_NFCONT_TLOCK);
@@ -249,26 +344,10 @@ static void s3c2440_nand_write(void *opaque, target_phys_addr_t addr,
         break;
     case S3C_NFDATA:
         if (s->nfcont & S3C_NFCONT_MODE) {
-        	if (s->nfcont & S3C_NFCONT_LOCK) {
-        		if (s->nfaddr_cur < (s->nfsblk << 6) ||
-        				s->nfaddr_cur > (s->nfeblk << 6)) {
-        			/* TODO: ADD IRQ */
-        			break;
-        		}
-        	}
-        	if (s->nfaddr_cur < 512) {
-        		if (!(s->nfcont & S3C_NFCONT_MECCL)) {
-        			value = ecc_digest(&s->nfecc, value & 0xff);
-        		/*	printf("ecc %02x -> %08x %08x cp %08x cnt %d\n", value, s->nfecc.lp[0], s->nfecc.lp[1], s->nfecc.cp, s->nfecc.count); */
-        		}
-        	} else {
-        		if (!(s->nfcont & S3C_NFCONT_SECCL))
-        			value = ecc_digest(&s->nfsecc, value & 0xff);
-        	}
-        	did_write=1;
-        	if (s->nfaddr_cur < 16) dbu[s->nfaddr_cur] = value;
-        	s->nfaddr_cur++;
-            nand_setio(s->nand, value & 0xff);
+            uint8_t data = value;
+
+            did_write=1;
+            s3c2440_nand_data_out(s, &data, 1);
         }
         break;
     case S3C_NFSBLK:
@@ -279,6 +358,10 @@ static void s3c2440_nand_write(void *opaque, target_phys_addr_t addr,
     	s->nfeblk = value & 0xffffff;
       /*  printf("%s: S3C_NFEBLK set to 0x%x\n", __FUNCTION__, value); */
     	break;
+    case S3C_NF8ECCCONF:
+        s3c2440_nand_ecc_flush(s);
+        ecc_bch_reset(&s->nfbch, value);
+        break;
 
     default:
         printf("%s: Bad register 0x%lx=%x\n", __FUNCTION__, (unsigned long)addr, value);
@@ -292,19 +375,29 @@ static void s3c2440_nand_write(void *opaque, target_phys_addr_t addr,
 static void s3c2440_nand_write16(void *opaque, target_phys_addr_t addr,
                 uint32_t value)
 {
-	s3c2440_nand_write(opaque, addr, value);
-	if (addr == S3C_NFDATA) {
-		s3c2440_nand_write(opaque, addr, value >> 8);
-	}
+    struct s3c2440_nand_s *s = (struct s3c2440_nand_s *) opaque;
+    uint8_t buf[2] = { value, value >> 8 };
+
+    if (addr != S3C_NFDATA) {
+        s3c2440_nand_write(opaque, addr, value);
+        return;
+    }
+    if (s->nand && (s->nfcont & S3C_NFCONT_MODE))
+        s3c2440_nand_data_out(s, buf, 2);
 }
 
 static void s3c2440_nand_write32(void *opaque, target_phys_addr_t addr,
                 uint32_t value)
 {
-	s3c2440_nand_write16(opaque, addr, value);
-	if (addr == S3C_NFDATA) {
-		s3c2440_nand_write16(opaque, addr, value >> 16);
-	}
+    struct s3c2440_nand_s *s = (struct s3c2440_nand_s *) opaque;
+    uint8_t buf[4] = { value, value >> 8, value >> 16, value >> 24 };
+
+    if (addr != S3C_NFDATA) {
+        s3c2440_nand_write(opaque, addr, value);
+        return;
+    }
+    if (s->nand && (s->nfcont & S3C_NFCONT_MODE))
+        s3c2440_nand_data_out(s, buf, 4);
 }
 
 static void s3c2440_nand_register(void * opaque, NANDFlashState *chip)
@@ -339,7 +432,10 @@ static void s3c2440_nand_save(QEMUFile *f, void *opaque)
     qemu_put_8s(f, &s->nfcmd);
     qemu_put_be32s(f, &s->nfaddr);
     qemu_put_be32(f, s->nfwp);
+    s3c2440_nand_ecc_flush(s);
     ecc_put(f, &s->nfecc);
+    ecc_put(f, &s->nfsecc);
+    ecc_bch_put(f, &s->nfbch);
 }
 
 static int s3c2440_nand_load(QEMUFile *f, void *opaque, int version_id)
@@ -351,6 +447,12 @@ static int s3c2440_nand_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_be32s(f, &s->nfaddr);
     s->nfwp = qemu_get_be32(f);
     ecc_get(f, &s->nfecc);
+    s->mecc_len = 0;
+    s->secc_len = 0;
+    if (version_id >= 1) {
+        ecc_get(f, &s->nfsecc);
+        ecc_bch_get(f, &s->nfbch);
+    }
     return 0;
 }
 
@@ -370,6 +472,6 @@ struct s3c_nand_driver_s * s3c2440_nand_init(void)
 	nand->driver.reset(nand);
 	iomemtype = cpu_register_io_memory(0, s3c2440_nand_readfn, s3c2440_nand_writefn, nand);
 	cpu_register_physical_memory(nand->nand_base, 0xffffff, iomemtype);
-	register_savevm("s3c2440_nand", 0, 0, s3c2440_nand_save, s3c2440_nand_load, nand);
+	register_savevm("s3c2440_nand", 0, 1, s3c2440_nand_save, s3c2440_nand_load, nand);
 	return &nand->driver;
 }
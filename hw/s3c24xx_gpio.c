@@ -28,6 +28,12 @@ struct s3c_gpio_state_s {	/* Modelled as an interrupt controller */
         uint32_t up;
         uint32_t mask;
         qemu_irq handler[32];
+
+        /* Compiled from GPxCON, EXTINTn and EINTMASK */
+        uint32_t in;	/* Lines that latch their input level */
+        uint32_t out;	/* Lines driven from GPxDAT */
+        uint32_t rise;	/* Unmasked EINTs triggered by a low-to-high change */
+        uint32_t fall;	/* Unmasked EINTs triggered by a high-to-low change */
     } bank[S3C_IO_BANKS];
 
     uint32_t inform[2];
@@ -40,73 +46,122 @@ struct s3c_gpio_state_s {	/* Modelled as an interrupt controller */
     uint32_t eintpend;
 };
 
-static inline void s3c_gpio_extint(struct s3c_gpio_state_s *s, int irq)
+/* First EINT number of the port's lines, or -1 if it has none */
+static inline int s3c_gpio_eint_base(int bank)
 {
-    if (s->eintmask & (1 << irq))
-        return;
-    s->eintpend |= (1 << irq) & 0x00fffff0;
-    switch (irq) {
-    case 0 ... 3:
-        qemu_irq_raise(s->pic[S3C_PIC_EINT0 + irq]);
-        break;
-    case 4 ... 7:
-        qemu_irq_raise(s->pic[S3C_PIC_EINT4]);
-        break;
-    case 8 ... 23:
-        qemu_irq_raise(s->pic[S3C_PIC_EINT8]);
-        break;
+    switch (bank) {
+    case 5:	/* GPF */
+        return 0;
+    case 6:	/* GPG */
+        return 8;
+    default:
+        return -1;
     }
 }
 
-static void s3c_gpio_set(void *opaque, int line, int level)
+/* Rebuilds the per-port line tables.  Only the GPxCON, EXTINTn and
+ * EINTMASK writes change them, so line changes never have to decode
+ * the configuration registers.  */
+static void s3c_gpio_compile(struct s3c_gpio_state_s *s, int bank)
 {
-    struct s3c_gpio_state_s *s = (struct s3c_gpio_state_s *) opaque;
-    int e, eint, bank = line >> 5;
-    line &= 0x1f;
-    /* Input ports */
-    if (bank > 0 && ((s->bank[bank].con >> (2 * line)) & 3) == 0) {
-        if (level)
-            s->bank[bank].dat |= 1 << line;
-        else
-            s->bank[bank].dat &= ~(1 << line);
+    int ln, eint, base = s3c_gpio_eint_base(bank);
+    uint32_t con = s->bank[bank].con;
+
+    s->bank[bank].in = 0;
+    s->bank[bank].rise = 0;
+    s->bank[bank].fall = 0;
+    if (!bank) {
+        /* GPA has one bit per line and no inputs */
+        s->bank[bank].out = ~con & s->bank[bank].mask;
         return;
     }
-    /* External interrupts */
-    if (((s->bank[bank].con >> (2 * line)) & 3) == 2) {
-        switch (bank) {
-        case 5:	/* GPF */
-            eint = line;
-            e = 0;
+    s->bank[bank].out = 0;
+
+    for (ln = 0; ln < s->bank[bank].n; ln ++)
+        switch ((con >> (2 * ln)) & 3) {
+        case 0:
+            s->bank[bank].in |= 1 << ln;
             break;
-        case 6:	/* GPG */
-            eint = line + 8;
-            e = (line > 15) ? 2 : 1;
+        case 1:
+            s->bank[bank].out |= 1 << ln;
+            break;
+        case 2:
+            if (base < 0)
+                break;
+            s->bank[bank].in |= 1 << ln;
+            eint = base + ln;
+            if (s->eintmask & (1 << eint))
+                break;
+            switch ((s->extint[eint >> 3] >> ((eint & 7) * 4)) & 7) {
+            case 0:		/* Low level */
+            case 2 ... 3:	/* Falling edge */
+                s->bank[bank].fall |= 1 << ln;
+                break;
+            case 1:		/* High level */
+            case 4 ... 5:	/* Rising edge */
+                s->bank[bank].rise |= 1 << ln;
+                break;
+            case 6 ... 7:	/* Both edges */
+                s->bank[bank].rise |= 1 << ln;
+                s->bank[bank].fall |= 1 << ln;
+                break;
+            }
             break;
-        default:
-            return;
-        }
-        if (level) {
-            if (!((s->bank[bank].dat >> line) & 1))
-                switch ((s->extint[e] >> (line * 4)) & 7) {
-                case 1:
-                case 4 ... 7:
-                    s3c_gpio_extint(s, eint);
-                    break;
-                }
-            s->bank[bank].dat |= 1 << line;
-        } else {
-            if ((s->bank[bank].dat >> line) & 1)
-                switch ((s->extint[e] >> (line * 4)) & 7) {
-                case 1:
-                case 4 ... 5:
-                    break;
-                default:
-                    s3c_gpio_extint(s, eint);
-                }
-            s->bank[bank].dat &= ~(1 << line);
         }
+}
+
+static void s3c_gpio_compile_eints(struct s3c_gpio_state_s *s)
+{
+    s3c_gpio_compile(s, 5);
+    s3c_gpio_compile(s, 6);
+}
+
+static void s3c_gpio_extint(struct s3c_gpio_state_s *s, uint32_t eints)
+{
+    int i;
+
+    s->eintpend |= eints & 0x00fffff0;
+    for (i = 0; i < 4; i ++)
+        if (eints & (1 << i))
+            qemu_irq_raise(s->pic[S3C_PIC_EINT0 + i]);
+    if (eints & 0x000000f0)
+        qemu_irq_raise(s->pic[S3C_PIC_EINT4]);
+    if (eints & 0x00ffff00)
+        qemu_irq_raise(s->pic[S3C_PIC_EINT8]);
+}
+
+static void s3c_gpio_update(struct s3c_gpio_state_s *s, int bank,
+                uint32_t mask, uint32_t values)
+{
+    uint32_t diff, eints;
+    int base;
+
+    diff = (s->bank[bank].dat ^ values) & mask & s->bank[bank].in;
+    if (!diff)
         return;
-    }
+    s->bank[bank].dat ^= diff;
+
+    eints = (diff & values & s->bank[bank].rise) |
+            (diff & ~values & s->bank[bank].fall);
+    if (eints && (base = s3c_gpio_eint_base(bank)) >= 0)
+        s3c_gpio_extint(s, eints << base);
+}
+
+static void s3c_gpio_set(void *opaque, int line, int level)
+{
+    struct s3c_gpio_state_s *s = (struct s3c_gpio_state_s *) opaque;
+
+    s3c_gpio_update(s, line >> 5, 1 << (line & 0x1f), level ? ~0 : 0);
+}
+
+/* Drives all input lines of PORT selected in MASK at once, with at
+ * most one interrupt request per EINT group.  */
+void s3c_gpio_set_mask(struct s3c_gpio_state_s *s, int port,
+                uint32_t mask, uint32_t values)
+{
+    if (port >= S3C_IO_BANKS)
+        cpu_abort(cpu_single_env, "%s: No I/O port %i\n", __FUNCTION__, port);
+    s3c_gpio_update(s, port, mask, values);
 }
 
 qemu_irq *s3c_gpio_in_get(struct s3c_gpio_state_s *s)
@@ -153,6 +208,9 @@ void s3c_gpio_reset(struct s3c_gpio_state_s *s)
     s->bank[0].con = 0x07ffffff;
     s->bank[3].up = 0x0000f000;
     s->bank[6].up = 0x0000f800;
+
+    for (i = 0; i < S3C_IO_BANKS; i ++)
+        s3c_gpio_compile(s, i);
 }
 
 void s3c_gpio_setpwrstat(struct s3c_gpio_state_s *s, int stat)
@@ -267,12 +325,15 @@ static void s3c_gpio_write(void *opaque, target_phys_addr_t addr,
         break;
     case S3C_EXTINT0:
         s->extint[0] = value;
+        s3c_gpio_compile_eints(s);
         break;
     case S3C_EXTINT1:
         s->extint[1] = value;
+        s3c_gpio_compile_eints(s);
         break;
     case S3C_EXTINT2:
         s->extint[2] = value;
+        s3c_gpio_compile_eints(s);
         break;
     case S3C_EINTFLT2:
         s->eintflt[0] = value;
@@ -282,6 +343,7 @@ static void s3c_gpio_write(void *opaque, target_phys_addr_t addr,
         break;
     case S3C_EINTMASK:
         s->eintmask = value & 0x00fffff0;
+        s3c_gpio_compile_eints(s);
         break;
     case S3C_EINTPEND:
         s->eintpend &= ~value;
@@ -289,19 +351,16 @@ static void s3c_gpio_write(void *opaque, target_phys_addr_t addr,
     /* Per bank registers */
     case S3C_GPCON:
         s->bank[bank].con = value;
+        s3c_gpio_compile(s, bank);
         break;
     case S3C_GPDAT:
-        diff = (s->bank[bank].dat ^ value) & s->bank[bank].mask;
+        diff = (s->bank[bank].dat ^ value) & s->bank[bank].out;
         s->bank[bank].dat = value;
     /*    printf("%s: write port '%c' = %08x\n", __FUNCTION__, 'A' + bank, s->bank[bank].dat); */
         while ((ln = ffs(diff))) {
             ln --;
-            if (s->bank[bank].handler[ln]) {
-                if (bank && ((s->bank[bank].con >> (2 * ln)) & 3) == 1)
-                    qemu_set_irq(s->bank[bank].handler[ln], (value >> ln) & 1);
-                else if (!bank && ((s->bank[bank].con >> ln) & 1) == 0)
-                    qemu_set_irq(s->bank[bank].handler[ln], (value >> ln) & 1);
-            }
+            if (s->bank[bank].handler[ln])
+                qemu_set_irq(s->bank[bank].handler[ln], (value >> ln) & 1);
             diff &= ~(1 << ln);
         }
         break;
@@ -374,6 +433,9 @@ static int s3c_gpio_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_be32s(f, &s->eintmask);
     qemu_get_be32s(f, &s->eintpend);
 
+    for (i = 0; i < S3C_IO_BANKS; i ++)
+        s3c_gpio_compile(s, i);
+
     return 0;
 }
 
@@ -42,6 +42,7 @@ struct s3c_lcd_state_s {
     int msb;
     int frm565;
     uint32_t palette[0x100];
+    int palette_depth;	/* Host depth the palette was converted for */
     int invalidate;
     int invalidatep;
     int src_width;
@@ -104,6 +105,8 @@ void s3c_lcd_reset(struct s3c_lcd_state_s *s)
 #define S3C_PALETTE	0x400	/* Palette IO start offset */
 #define S3C_PALETTEEND	0x5ff	/* Palette IO end offset */
 
+static uint32_t s3c_lcd_palette_entry(struct s3c_lcd_state_s *s, int i);
+
 static uint32_t s3c_lcd_read(void *opaque, target_phys_addr_t addr)
 {
     struct s3c_lcd_state_s *s = (struct s3c_lcd_state_s *) opaque;
@@ -237,6 +240,13 @@ static void s3c_lcd_write(void *opaque, target_phys_addr_t addr,
     case S3C_PALETTE ... S3C_PALETTEEND:
         /* XXX assuming 16bit access */
         s->raw_pal[(addr - S3C_PALETTE) >> 1] = value;
+        /* Only the TFT modes use the palette memory */
+        if (s->bpp & 8) {
+            if (!s->invalidatep)
+                s->palette[(addr - S3C_PALETTE) >> 1] =
+                        s3c_lcd_palette_entry(s, (addr - S3C_PALETTE) >> 1);
+            s->invalidate = 1;
+        }
         break;
     default:
         printf("%s: Bad register 0x%lx\n", __FUNCTION__, (unsigned long)addr);
@@ -263,6 +273,7 @@ static inline void s3c_lcd_resize(struct s3c_lcd_state_s *s)
     if (s->width != new_width || s->height != new_height) {
         s->width = new_width;
         s->height = new_height;
+        s->invalidatep = 1;
 
 	if (graphic_rotate) {
 		qemu_console_resize(s->ds, s->height, s->width);
@@ -323,9 +334,25 @@ static inline uint32_t s3c_rgb(struct s3c_lcd_state_s *s,
     }
 }
 
+/* Converts a palette memory entry for the TFT modes */
+static uint32_t s3c_lcd_palette_entry(struct s3c_lcd_state_s *s, int i)
+{
+    if (s->frm565)
+        return s3c_rgb(s,
+                        (s->raw_pal[i] >> 10) & 0x3e,
+                        (s->raw_pal[i] >> 5) & 0x3f,
+                        (s->raw_pal[i] << 1) & 0x3e);
+    else
+        return s3c_rgb(s,
+                        ((s->raw_pal[i] >> 10) & 0x3e) | (s->raw_pal[i] & 1),
+                        ((s->raw_pal[i] >> 6) & 0x3e) | (s->raw_pal[i] & 1),
+                        s->raw_pal[i] & 0x3f);
+}
+
 static void s3c_lcd_palette_load(struct s3c_lcd_state_s *s)
 {
     int i, n;
+    s->palette_depth = ds_get_bits_per_pixel(s->ds);
     switch (s->bpp) {
     case 0:
     case 8:
@@ -371,16 +398,7 @@ static void s3c_lcd_palette_load(struct s3c_lcd_state_s *s)
     }
     if (s->bpp & 8) {
         for (i = 0; i < n; i ++)
-            if (s->frm565)
-                s->palette[i] = s3c_rgb(s,
-                        (s->raw_pal[i] >> 10) & 0x3e,
-                        (s->raw_pal[i] >> 5) & 0x3f,
-                        (s->raw_pal[i] << 1) & 0x3e);
-            else
-                s->palette[i] = s3c_rgb(s,
-                        ((s->raw_pal[i] >> 10) & 0x3e) | (s->raw_pal[i] & 1),
-                        ((s->raw_pal[i] >> 6) & 0x3e) | (s->raw_pal[i] & 1),
-                        s->raw_pal[i] & 0x3f);
+            s->palette[i] = s3c_lcd_palette_entry(s, i);
     } else {
         for (i = 0; i < n; i ++)
             if (n < 256)
@@ -396,6 +414,27 @@ static void s3c_lcd_palette_load(struct s3c_lcd_state_s *s)
     }
 }
 
+/*
+ * Checks the VGA dirty bits of the whole framebuffer at once so that a
+ * static frame costs one pass over the page flags instead of a render.
+ */
+static int s3c_lcd_dirty(target_phys_addr_t base, int len)
+{
+    ram_addr_t pd = cpu_get_physical_page_desc(base);
+    ram_addr_t addr, end;
+
+    /* Let framebuffer_update_display() deal with odd mappings */
+    if ((pd & ~TARGET_PAGE_MASK) > IO_MEM_ROM)
+        return 1;
+
+    addr = (pd & TARGET_PAGE_MASK) + (base & ~TARGET_PAGE_MASK);
+    end = addr + len;
+    for (addr &= TARGET_PAGE_MASK; addr < end; addr += TARGET_PAGE_SIZE)
+        if (cpu_physical_memory_get_dirty(addr, VGA_DIRTY_FLAG))
+            return 1;
+    return 0;
+}
+
 static void s3c_update_display(void *opaque)
 {
     struct s3c_lcd_state_s *s = (struct s3c_lcd_state_s *) opaque;
@@ -404,15 +443,24 @@ static void s3c_update_display(void *opaque)
     int first, last;
     int dest_row_pitch, dest_col_pitch;
 
-    s3c_lcd_resize(s);
+    /* Geometry and palette only change on register writes */
+    if (s->invalidate)
+        s3c_lcd_resize(s);
 
-    if (s->invalidatep) {
+    if (s->invalidatep || s->palette_depth != ds_get_bits_per_pixel(s->ds)) {
         s3c_lcd_palette_load(s);
         s->invalidatep = 0;
+        s->invalidate = 1;
     }
 
     addr = s->saddr[0]<<1;
 
+    s->srcpnd |= (1 << 1);			/* INT_FrSyn */
+    s3c_lcd_update(s);
+
+    if (!s->invalidate && !s3c_lcd_dirty(addr, s->src_width * s->height))
+        return;
+
     if (graphic_rotate) {
 	    dest_row_pitch = s->dest_width;
 	    dest_col_pitch = -s->height * s->dest_width;
@@ -430,8 +478,6 @@ static void s3c_update_display(void *opaque)
                                s->fn, s->palette,
                                &first, &last);
 
-    s->srcpnd |= (1 << 1);			/* INT_FrSyn */
-    s3c_lcd_update(s);
     if (first >= 0) {
         if (graphic_rotate)
 		dpy_update(s->ds, first, 0, last - first + 1, s->width);
@@ -463,6 +509,124 @@ static void s3c_screen_dump(void *opaque, const char *filename)
 #define BITS 32
 #include "s3c24xx_template.h"
 
+/*
+ * Vectorised versions of the two most common 32bpp host conversions,
+ * 16bpp 5:6:5 and 24bpp (unpacked) TFT.  They produce exactly the same
+ * pixels as the template functions, which handle the rotated case
+ * (deststep != 4) and the trailing pixels of each line.
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && QEMU_GNUC_PREREQ(4, 9)
+#include <immintrin.h>
+
+#define S3C_LCD_SIMD
+
+__attribute__((target("sse2")))
+static void s3c_draw_line16a_32_sse2(void *opaque,
+                uint8_t *dest, const uint8_t *src, int width, int deststep)
+{
+    const __m128i mask_rb = _mm_set1_epi16(0xf8);
+    const __m128i mask_g = _mm_set1_epi16(0xfc);
+    __m128i p, bg, r;
+
+    if (deststep != 4)
+        goto tail;
+    for (; width >= 8; width -= 8, src += 16, dest += 32) {
+        p = _mm_loadu_si128((const __m128i *) src);
+        bg = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(p, 3), mask_rb),
+                        _mm_slli_epi16(_mm_and_si128(_mm_srli_epi16(p, 3),
+                                        mask_g), 8));
+        r = _mm_and_si128(_mm_srli_epi16(p, 8), mask_rb);
+        _mm_storeu_si128((__m128i *) dest, _mm_unpacklo_epi16(bg, r));
+        _mm_storeu_si128((__m128i *) (dest + 16), _mm_unpackhi_epi16(bg, r));
+    }
+tail:
+    if (width > 0)
+        s3c_draw_line16a_32(opaque, dest, src, width, deststep);
+}
+
+__attribute__((target("sse2")))
+static void s3c_draw_line24_32_sse2(void *opaque,
+                uint8_t *dest, const uint8_t *src, int width, int deststep)
+{
+    const __m128i mask = _mm_set1_epi32(0x00ffffff);
+
+    if (deststep != 4)
+        goto tail;
+    for (; width >= 4; width -= 4, src += 16, dest += 16)
+        _mm_storeu_si128((__m128i *) dest, _mm_and_si128(mask,
+                                _mm_loadu_si128((const __m128i *) src)));
+tail:
+    if (width > 0)
+        s3c_draw_line24_32(opaque, dest, src, width, deststep);
+}
+
+__attribute__((target("avx2")))
+static void s3c_draw_line16a_32_avx2(void *opaque,
+                uint8_t *dest, const uint8_t *src, int width, int deststep)
+{
+    const __m256i mask_rb = _mm256_set1_epi16(0xf8);
+    const __m256i mask_g = _mm256_set1_epi16(0xfc);
+    __m256i p, bg, r, lo, hi;
+
+    if (deststep != 4)
+        goto tail;
+    for (; width >= 16; width -= 16, src += 32, dest += 64) {
+        p = _mm256_loadu_si256((const __m256i *) src);
+        bg = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(p, 3),
+                                mask_rb),
+                        _mm256_slli_epi16(_mm256_and_si256(
+                                        _mm256_srli_epi16(p, 3), mask_g), 8));
+        r = _mm256_and_si256(_mm256_srli_epi16(p, 8), mask_rb);
+        /* The unpacks work within each 128-bit lane */
+        lo = _mm256_unpacklo_epi16(bg, r);
+        hi = _mm256_unpackhi_epi16(bg, r);
+        _mm256_storeu_si256((__m256i *) dest,
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (dest + 32),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+tail:
+    if (width > 0)
+        s3c_draw_line16a_32_sse2(opaque, dest, src, width, deststep);
+}
+
+__attribute__((target("avx2")))
+static void s3c_draw_line24_32_avx2(void *opaque,
+                uint8_t *dest, const uint8_t *src, int width, int deststep)
+{
+    const __m256i mask = _mm256_set1_epi32(0x00ffffff);
+
+    if (deststep != 4)
+        goto tail;
+    for (; width >= 8; width -= 8, src += 32, dest += 32)
+        _mm256_storeu_si256((__m256i *) dest, _mm256_and_si256(mask,
+                                _mm256_loadu_si256((const __m256i *) src)));
+tail:
+    if (width > 0)
+        s3c_draw_line24_32_sse2(opaque, dest, src, width, deststep);
+}
+
+static drawfn s3c_draw_fn_32_simd[8];
+
+/* Picks the widest converters the host CPU supports */
+static drawfn *s3c_lcd_simd_init(void)
+{
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2"))
+        return s3c_draw_fn_32;
+
+    memcpy(s3c_draw_fn_32_simd, s3c_draw_fn_32, sizeof(s3c_draw_fn_32));
+    if (__builtin_cpu_supports("avx2")) {
+        s3c_draw_fn_32_simd[5] = s3c_draw_line16a_32_avx2;
+        s3c_draw_fn_32_simd[7] = s3c_draw_line24_32_avx2;
+    } else {
+        s3c_draw_fn_32_simd[5] = s3c_draw_line16a_32_sse2;
+        s3c_draw_fn_32_simd[7] = s3c_draw_line24_32_sse2;
+    }
+    return s3c_draw_fn_32_simd;
+}
+#endif
+
 static void s3c_lcd_save(QEMUFile *f, void *opaque)
 {
     struct s3c_lcd_state_s *s = (struct s3c_lcd_state_s *) opaque;
@@ -561,7 +725,11 @@ struct s3c_lcd_state_s *s3c_lcd_init(target_phys_addr_t base,
         s->dest_width = 3;
         break;
     case 32:
+#ifdef S3C_LCD_SIMD
+        s->line_fn = s3c_lcd_simd_init();
+#else
         s->line_fn = s3c_draw_fn_32;
+#endif
         s->dest_width = 4;
         break;
     default:
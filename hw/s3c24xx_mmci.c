@@ -36,6 +36,10 @@
 
 #define S3C2410_SDIDSTA_COMPLETION	(S3C2410_SDIDSTA_TXDATAON|S3C2410_SDIDSTA_RXDATAON)
 
+#define S3C_MMCI_FIFO	64	/* FIFO depth seen by the CPU */
+#define S3C_MMCI_RING	512	/* Backing store, a block deep for DMA */
+#define S3C_MMCI_MASK	(S3C_MMCI_RING - 1)
+
 struct s3c_mmci_state_s {
     target_phys_addr_t base;
     qemu_irq irq;
@@ -47,7 +51,7 @@ struct s3c_mmci_state_s {
     int blknum;
     int blklen_cnt;
     int blknum_cnt;
-    uint8_t fifo[64];
+    uint8_t fifo[S3C_MMCI_RING];
     int fifolen;
     int fifostart;
     int data;
@@ -93,28 +97,47 @@ void s3c_mmci_reset(struct s3c_mmci_state_s *s)
     s->prescaler = 0;
 }
 
+/*
+ * In DMA mode the guest does not look at the FIFO level, so the FIFO is
+ * allowed to hold a whole block and data moves to and from the card a
+ * block at a time rather than a few bytes per DMA beat.
+ */
 static void s3c_mmci_fifo_run(struct s3c_mmci_state_s *s)
 {
-    int len, dmalevel = 0;
-    if (!s->data)
+    int len, vlen, n, done, depth, dmalevel = 0;
+    if (!s->data) {
+        if (((s->dcontrol >> 12) & 3) == 2)			/* DatMode */
+            dmalevel = !!s->fifolen;
         goto dmaupdate;
+    }
 
+    depth = (s->dcontrol & S3C2410_SDIDCON_DMAEN) ?			/* EnDMA */
+            S3C_MMCI_RING : S3C_MMCI_FIFO;
     len = s->fifolen;
+    vlen = MIN(len, S3C_MMCI_FIFO);
     if (((s->dcontrol >> 12) & 3) == 2) {			/* DatMode */
         s->dstatus &= ~S3C2410_SDIDSTA_COMPLETION;
         s->dstatus |= S3C2410_SDIDSTA_RXDATAON;					/* RxDatOn */
-        while (s->fifolen < 64 && s->blklen_cnt) {
-            s->fifo[(s->fifostart + s->fifolen ++) & 63] =
-                    sd_read_data(s->card);
-            if (!(-- s->blklen_cnt))
+        while (s->fifolen < depth && s->blklen_cnt &&
+                        (depth == S3C_MMCI_FIFO || len < 4)) {
+            n = MIN(depth - s->fifolen, s->blklen_cnt);
+            n = MIN(n, S3C_MMCI_RING -
+                            ((s->fifostart + s->fifolen) & S3C_MMCI_MASK));
+            done = sd_read_data_block(s->card, s->fifo +
+                            ((s->fifostart + s->fifolen) & S3C_MMCI_MASK), n);
+            s->fifolen += done;
+            if (!(s->blklen_cnt -= done))
                 if (-- s->blknum_cnt)
                     s->blklen_cnt = s->blklen;
+            if (done < n)
+                break;	/* Card busy, resumed by s3c_mmci_busy */
         }
+        n = MIN(s->fifolen, S3C_MMCI_FIFO);
         if ((s->mask & S3C2410_SDIIMSK_RXFIFOHALF) &&				/* RFHalf */
-                        s->fifolen > 31 && len < 32)
+                        n > 31 && vlen < 32)
             qemu_irq_raise(s->irq);
         if ((s->mask & S3C2410_SDIIMSK_RXFIFOFULL) &&				/* RFFull */
-                        s->fifolen > 63 && len < 64)
+                        n > 63 && vlen < 64)
             qemu_irq_raise(s->irq);
         if ((s->mask & S3C2410_SDIIMSK_RXFIFOLAST) && !s->blklen_cnt)		/* RFLast */
             qemu_irq_raise(s->irq);
@@ -122,20 +145,29 @@ static void s3c_mmci_fifo_run(struct s3c_mmci_state_s *s)
     } else if (((s->dcontrol >> 12) & 3) == 3) {		/* DatMode */
         s->dstatus &= ~S3C2410_SDIDSTA_COMPLETION;
         s->dstatus |= S3C2410_SDIDSTA_TXDATAON;					/* TxDatOn */
-        while (s->fifolen && s->blklen_cnt) {
-            sd_write_data(s->card, s->fifo[s->fifostart ++]);
-            s->fifostart &= 63;
-            s->fifolen --;
-            if (!(-- s->blklen_cnt))
+        while (s->fifolen && s->blklen_cnt && (depth == S3C_MMCI_FIFO ||
+                                s->fifolen >= MIN(s->blklen_cnt, depth))) {
+            n = MIN(s->fifolen, s->blklen_cnt);
+            n = MIN(n, S3C_MMCI_RING - s->fifostart);
+            done = sd_write_data_block(s->card, s->fifo + s->fifostart, n);
+            s->fifostart = (s->fifostart + done) & S3C_MMCI_MASK;
+            s->fifolen -= done;
+            if (!(s->blklen_cnt -= done))
                 if (-- s->blknum_cnt)
                     s->blklen_cnt = s->blklen;
+            if (done < n)
+                break;	/* Card busy, resumed by s3c_mmci_busy */
         }
-        if ((s->mask & S3C2410_SDIIMSK_TXFIFOEMPTY) && !s->fifolen && len)		/* TFEmpty */
+        n = MIN(s->fifolen, S3C_MMCI_FIFO);
+        if ((s->mask & S3C2410_SDIIMSK_TXFIFOEMPTY) && !n && len)		/* TFEmpty */
             qemu_irq_raise(s->irq);
         if ((s->mask & S3C2410_SDIIMSK_TXFIFOHALF) &&				/* TFHalf */
-                        s->fifolen < 33 && len > 32)
+                        n < 33 && vlen > 32)
             qemu_irq_raise(s->irq);
-        dmalevel = (s->fifolen < 64) && (s->blklen_cnt > 0);
+        dmalevel = (s->fifolen < depth) && (s->blklen_cnt > 0);
+        /* The last block is only done once the card has stored it */
+        if (!s->blklen_cnt && sd_busy(s->card))
+            goto dmaupdate;
     } else
         return;
 
@@ -194,6 +226,7 @@ static void s3c_mmci_cmd_submit(struct s3c_mmci_state_s *s)
 complete:
     s->blklen_cnt = s->blklen;
     s->blknum_cnt = s->blknum;
+    sd_set_block_count(s->card, s->blknum);
 
     s->data = 0;
     if (((s->dcontrol >> 12) & 3) == 1) {			/* DatMode */
@@ -258,31 +291,32 @@ static uint32_t s3c_mmci_readw(void *opaque, target_phys_addr_t addr)
         return s->dstatus;
     case S3C_SDIFSTA:
         /* TODO: S3C2440 these bits have to cleared explicitely.  */
+        ret = MIN(s->fifolen, S3C_MMCI_FIFO);
         if (((s->dcontrol >> 12) & 3) == 2)			/* DatMode */
-            return s->fifolen |					/* FFCNT */
-                ((s->fifolen > 31) ? S3C2410_SDIFSTA_RFHALF : 0) |		/* RFHalf */
-                ((s->fifolen > 63) ? S3C2410_SDIFSTA_RFFULL : 0) |		/* RFFulx */
+            return ret |					/* FFCNT */
+                ((ret > 31) ? S3C2410_SDIFSTA_RFHALF : 0) |		/* RFHalf */
+                ((ret > 63) ? S3C2410_SDIFSTA_RFFULL : 0) |		/* RFFulx */
                 (s->blklen_cnt ? 0 : S3C2410_SDIFSTA_RFLAST) |		/* RFLast */
                 (3 << 10) |					/* TFHalf */
-                (s->fifolen ? (1 << 12) : 0);			/* RFDET */
+                (ret ? (1 << 12) : 0);			/* RFDET */
         else if (((s->dcontrol >> 12) & 3) == 3)		/* DatMode */
-            return s->fifolen |					/* FFCNT */
-                (s->fifolen ? 0 : S3C2410_SDIFSTA_TFEMPTY) |			/* TFEmpty */
-                ((s->fifolen < 33) ? S3C2410_SDIFSTA_TFHALF : 0) |		/* TFHalf */
-                ((s->fifolen < 64) ? S3C2410_SDIFSTA_TFDET : 0);		/* TFDET */
+            return ret |					/* FFCNT */
+                (ret ? 0 : S3C2410_SDIFSTA_TFEMPTY) |			/* TFEmpty */
+                ((ret < 33) ? S3C2410_SDIFSTA_TFHALF : 0) |		/* TFHalf */
+                ((ret < 64) ? S3C2410_SDIFSTA_TFDET : 0);		/* TFDET */
         else
-            return s->fifolen;					/* FFCNT */
+            return ret;					/* FFCNT */
     case S3C_SDIDAT:
         ret = 0;
         if (s->fifolen >= 4) {
             ret |= s->fifo[s->fifostart ++] << 0;
-            s->fifostart &= 63;
+            s->fifostart &= S3C_MMCI_MASK;
             ret |= s->fifo[s->fifostart ++] << 8;
-            s->fifostart &= 63;
+            s->fifostart &= S3C_MMCI_MASK;
             ret |= s->fifo[s->fifostart ++] << 16;
-            s->fifostart &= 63;
+            s->fifostart &= S3C_MMCI_MASK;
             ret |= s->fifo[s->fifostart ++] << 24;
-            s->fifostart &= 63;
+            s->fifostart &= S3C_MMCI_MASK;
             s->fifolen -= 4;
             s3c_mmci_fifo_run(s);
         } else
@@ -337,6 +371,7 @@ static void s3c_mmci_writew(void *opaque, target_phys_addr_t addr,
     case S3C_SDIDCON:
 		s->dcontrol = value;
 		s->blknum = value & 0xfff;
+		sd_set_block_count(s->card, s->blknum);
 		if (value & (1 << 14)) /* STOP */
 			s->data = 0;
 		if (((s->dcontrol >> 12) & 3) == 1) { /* DatMode */
@@ -357,10 +392,10 @@ static void s3c_mmci_writew(void *opaque, target_phys_addr_t addr,
     	/* write is tolerated on the s3c2440 */
     	break;
     case S3C_SDIDAT:
-        s->fifo[(s->fifostart + s->fifolen ++) & 63] = (value >> 0) & 0xff;
-        s->fifo[(s->fifostart + s->fifolen ++) & 63] = (value >> 8) & 0xff;
-        s->fifo[(s->fifostart + s->fifolen ++) & 63] = (value >> 16) & 0xff;
-        s->fifo[(s->fifostart + s->fifolen ++) & 63] = (value >> 24) & 0xff;
+        s->fifo[(s->fifostart + s->fifolen ++) & S3C_MMCI_MASK] = (value >> 0) & 0xff;
+        s->fifo[(s->fifostart + s->fifolen ++) & S3C_MMCI_MASK] = (value >> 8) & 0xff;
+        s->fifo[(s->fifostart + s->fifolen ++) & S3C_MMCI_MASK] = (value >> 16) & 0xff;
+        s->fifo[(s->fifostart + s->fifolen ++) & S3C_MMCI_MASK] = (value >> 24) & 0xff;
         s3c_mmci_fifo_run(s);
         break;
     case S3C_SDIMSK:
@@ -380,9 +415,9 @@ static uint32_t s3c_mmci_readh(void *opaque, target_phys_addr_t addr)
     if (s->map[addr - s->base] == S3C_SDIDAT) {
         if (s->fifolen >= 2) {
             ret |= s->fifo[s->fifostart ++] << 0;
-            s->fifostart &= 63;
+            s->fifostart &= S3C_MMCI_MASK;
             ret |= s->fifo[s->fifostart ++] << 8;
-            s->fifostart &= 63;
+            s->fifostart &= S3C_MMCI_MASK;
             s->fifolen -= 2;
             s3c_mmci_fifo_run(s);
         } else
@@ -401,8 +436,8 @@ static void s3c_mmci_writeh(void *opaque, target_phys_addr_t addr,
     struct s3c_mmci_state_s *s = (struct s3c_mmci_state_s *) opaque;
 
     if (s->map[addr - s->base] == S3C_SDIDAT) {
-        s->fifo[(s->fifostart + s->fifolen ++) & 63] = (value >> 0) & 0xff;
-        s->fifo[(s->fifostart + s->fifolen ++) & 63] = (value >> 8) & 0xff;
+        s->fifo[(s->fifostart + s->fifolen ++) & S3C_MMCI_MASK] = (value >> 0) & 0xff;
+        s->fifo[(s->fifostart + s->fifolen ++) & S3C_MMCI_MASK] = (value >> 8) & 0xff;
         s3c_mmci_fifo_run(s);
     } else
         printf("%s: Bad register 0x%lx\n", __FUNCTION__, (unsigned long int)(addr - s->base));
@@ -416,7 +451,7 @@ static uint32_t s3c_mmci_readb(void *opaque, target_phys_addr_t addr)
     if (s->map[addr - s->base] == S3C_SDIDAT) {
         if (s->fifolen > 0) {
             ret = s->fifo[s->fifostart ++];
-            s->fifostart &= 63;
+            s->fifostart &= S3C_MMCI_MASK;
             s->fifolen --;
             s3c_mmci_fifo_run(s);
         } else
@@ -435,7 +470,7 @@ static void s3c_mmci_writeb(void *opaque, target_phys_addr_t addr,
     struct s3c_mmci_state_s *s = (struct s3c_mmci_state_s *) opaque;
 
     if (s->map[addr - s->base] == S3C_SDIDAT) {
-        s->fifo[(s->fifostart + s->fifolen ++) & 63] = value;
+        s->fifo[(s->fifostart + s->fifolen ++) & S3C_MMCI_MASK] = value;
         s3c_mmci_fifo_run(s);
     } else
         printf("%s: Bad register 0x%lx\n", __FUNCTION__, (unsigned long int)(addr - s->base));
@@ -469,6 +504,15 @@ static void s3c_mmci_cardirq(void *opaque, int line, int level)
         qemu_irq_raise(s->irq);
 }
 
+/* DAT0 busy from the card, carry on with the transfer when it's ready */
+static void s3c_mmci_busy(void *opaque, int line, int level)
+{
+    struct s3c_mmci_state_s *s = (struct s3c_mmci_state_s *) opaque;
+
+    if (!level)
+        s3c_mmci_fifo_run(s);
+}
+
 static void s3c_mmci_save(QEMUFile *f, void *opaque)
 {
     struct s3c_mmci_state_s *s = (struct s3c_mmci_state_s *) opaque;
@@ -545,9 +589,22 @@ static int s3c_mmci_load(QEMUFile *f, void *opaque, int version_id)
     s->blknum = qemu_get_be32(f);
     s->blklen_cnt = qemu_get_be32(f);
     s->blknum_cnt = qemu_get_be32(f);
-    qemu_get_buffer(f, s->fifo, sizeof(s->fifo));
-    s->fifolen = qemu_get_be32(f);
-    s->fifostart = qemu_get_be32(f);
+    if (version_id < 1) {
+        /* The FIFO used to be 64 bytes, realign it at the start */
+        uint8_t fifo[S3C_MMCI_FIFO];
+        int i;
+
+        qemu_get_buffer(f, fifo, sizeof(fifo));
+        s->fifolen = qemu_get_be32(f);
+        s->fifostart = qemu_get_be32(f);
+        for (i = 0; i < S3C_MMCI_FIFO; i ++)
+            s->fifo[i] = fifo[(s->fifostart + i) & (S3C_MMCI_FIFO - 1)];
+        s->fifostart = 0;
+    } else {
+        qemu_get_buffer(f, s->fifo, sizeof(s->fifo));
+        s->fifolen = qemu_get_be32(f);
+        s->fifostart = qemu_get_be32(f);
+    }
     s->data = qemu_get_be32(f);
 
     qemu_get_be32s(f, &s->control);
@@ -597,6 +654,7 @@ struct s3c_mmci_state_s *s3c_mmci_init(target_phys_addr_t base, uint32_t cpu_id,
     }
 
     sd_set_cb(mmc, 0, qemu_allocate_irqs(s3c_mmci_cardirq, s, 1)[0]);
+    sd_set_busy_cb(mmc, qemu_allocate_irqs(s3c_mmci_busy, s, 1)[0]);
 
     s3c_mmci_reset(s);
 
@@ -604,7 +662,7 @@ struct s3c_mmci_state_s *s3c_mmci_init(target_phys_addr_t base, uint32_t cpu_id,
                     s3c_mmci_writefn, s);
     cpu_register_physical_memory(s->base, 0xffffff, iomemtype);
 
-    register_savevm("s3c24xx_mmci", 0, 0, s3c_mmci_save, s3c_mmci_load, s);
+    register_savevm("s3c24xx_mmci", 0, 1, s3c_mmci_save, s3c_mmci_load, s);
 
     return s;
 }
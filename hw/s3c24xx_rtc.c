@@ -12,14 +12,29 @@
 #include "hw.h"
 #include "sysemu.h"
 
+#define S3C_RTC_TICK_FREQ	128		/* Hz */
+
+/*
+ * The wall time is never counted: it is (vm_clock + offset) in
+ * vm_clock ticks and the BCD registers are derived from it when they
+ * are read.  Host timers are only armed for an enabled alarm and for
+ * the tick while its interrupt is unmasked, a masked tick catches up
+ * when the guest looks at SRCPND (see s3c_pic_sync_add).
+ */
 struct s3c_rtc_state_s {
     target_phys_addr_t base;
-    qemu_irq irq;
+    struct s3c_pic_state_s *pic;
+    qemu_irq tick_irq;
+    qemu_irq alarm_irq;
     int enable;
-    QEMUTimer *timer;
-    QEMUTimer *hz;
-    int64_t next;
-    struct tm tm;
+    QEMUTimer *tick_timer;
+    QEMUTimer *alarm_timer;
+    int64_t offset;
+    int64_t tick_next;
+    int64_t alarm_next;		/* Wall time in seconds, or -1 */
+    int32_t wday_delta;
+    int pending;		/* Date fields written but not a date yet */
+    struct tm set;
 
     uint8_t control;
     uint8_t tick;
@@ -31,75 +46,216 @@ struct s3c_rtc_state_s {
     uint8_t almmon;
     uint8_t almyear;
     uint8_t reset;
-    uint32_t sec;
 };
 
-void s3c_rtc_reset(struct s3c_rtc_state_s *s)
+static inline uint32_t to_bcd(int val)
 {
-    time_t ti;
-    s->control = 0x00;
-    s->enable = 0;
-    s->tick = 0x00;
-    s->alarm = 0x00;
-    s->almsec = 0x00;
-    s->almmin = 0x00;
-    s->almhour = 0x00;
-    s->almday = 0x01;
-    s->almmon = 0x01;
-    s->almyear = 0x00;
-    s->reset = 0;
-    time(&ti);
-    s->sec = ti;
+    return ((val / 10) << 4) | (val % 10);
 }
 
-static void s3c_rtc_tick_mod(struct s3c_rtc_state_s *s)
+static inline int from_bcd(uint32_t val)
 {
-    qemu_mod_timer(s->timer,
-                    qemu_get_clock(vm_clock) + muldiv64((s->tick & 0x7f) + 1,
-                            ticks_per_sec, S3C_XTAL_FREQ));
+    return ((val >> 4) * 10) + (val & 0x0f);
 }
 
-static void s3c_rtc_tick(void *opaque)
+static inline int64_t s3c_rtc_now(struct s3c_rtc_state_s *s)
 {
-    struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
-    if (!(s->tick & (1 << 7)))
+    return (qemu_get_clock(vm_clock) + s->offset) / ticks_per_sec;
+}
+
+static void s3c_rtc_time(struct s3c_rtc_state_s *s, struct tm *tm)
+{
+    time_t ti = s3c_rtc_now(s);
+
+    gmtime_r(&ti, tm);
+}
+
+/* The BCD fields as the guest wrote them, or else the current time */
+static void s3c_rtc_fields(struct s3c_rtc_state_s *s, struct tm *tm)
+{
+    if (s->pending)
+        *tm = s->set;
+    else
+        s3c_rtc_time(s, tm);
+}
+
+static int s3c_rtc_valid(struct tm *tm)
+{
+    static const int mdays[12] = {
+        31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31,
+    };
+    int year = tm->tm_year + 1900;
+    int leap = (!(year % 4) && (year % 100)) || !(year % 400);
+
+    return tm->tm_sec >= 0 && tm->tm_sec < 60 &&
+            tm->tm_min >= 0 && tm->tm_min < 60 &&
+            tm->tm_hour >= 0 && tm->tm_hour < 24 &&
+            tm->tm_mon >= 0 && tm->tm_mon < 12 && tm->tm_mday >= 1 &&
+            tm->tm_mday <= mdays[tm->tm_mon] + (tm->tm_mon == 1 && leap);
+}
+
+static void s3c_rtc_tick_update(struct s3c_rtc_state_s *s)
+{
+    int64_t now, period;
+
+    if (!(s->tick & (1 << 7))) {
+        qemu_del_timer(s->tick_timer);
         return;
-    qemu_irq_raise(s->irq);
+    }
+
+    now = qemu_get_clock(vm_clock);
+    if (now >= s->tick_next) {
+        qemu_irq_raise(s->tick_irq);
+
+        period = muldiv64((s->tick & 0x7f) + 1,
+                        ticks_per_sec, S3C_RTC_TICK_FREQ);
+        s->tick_next += period;
+        if (now >= s->tick_next)
+            s->tick_next += ((now - s->tick_next) / period + 1) * period;
+    }
 
-    s3c_rtc_tick_mod(s);
+    if (s3c_pic_masked(s->pic, S3C_PIC_TICK))
+        qemu_del_timer(s->tick_timer);
+    else
+        qemu_mod_timer(s->tick_timer, s->tick_next);
 }
 
-static void s3c_rtc_hz(void *opaque)
+/* Also the PIC sync hook */
+static void s3c_rtc_tick(void *opaque)
 {
-    struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
+    s3c_rtc_tick_update((struct s3c_rtc_state_s *) opaque);
+}
 
-    s->sec ++;
-    s->next += 1000;
-    qemu_mod_timer(s->hz, s->next);
+/* Returns the first second after T that matches the enabled alarm
+ * fields, or -1 if there's none within a century or so.  Fields that
+ * don't match are skipped a whole unit at a time.  */
+static int64_t s3c_rtc_alarm_match(struct s3c_rtc_state_s *s, int64_t t)
+{
+    struct tm tm;
+    time_t ti;
+    int i;
+
+    for (t ++, i = 0; i < 2000; i ++) {
+        ti = t;
+        gmtime_r(&ti, &tm);
+        if ((s->alarm & (1 << 5)) &&
+                        tm.tm_year % 100 != from_bcd(s->almyear)) {
+            tm.tm_year ++;
+            tm.tm_mon = 0;
+            tm.tm_mday = 1;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+            tm.tm_sec = 0;
+        } else if ((s->alarm & (1 << 4)) &&
+                        tm.tm_mon + 1 != from_bcd(s->almmon)) {
+            if (++ tm.tm_mon == 12) {
+                tm.tm_year ++;
+                tm.tm_mon = 0;
+            }
+            tm.tm_mday = 1;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+            tm.tm_sec = 0;
+        } else if ((s->alarm & (1 << 3)) &&
+                        tm.tm_mday != from_bcd(s->almday)) {
+            tm.tm_mday ++;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+            tm.tm_sec = 0;
+        } else if ((s->alarm & (1 << 2)) &&
+                        tm.tm_hour != from_bcd(s->almhour)) {
+            tm.tm_hour ++;
+            tm.tm_min = 0;
+            tm.tm_sec = 0;
+        } else if ((s->alarm & (1 << 1)) &&
+                        tm.tm_min != from_bcd(s->almmin)) {
+            tm.tm_min ++;
+            tm.tm_sec = 0;
+        } else if ((s->alarm & (1 << 0)) &&
+                        tm.tm_sec != from_bcd(s->almsec)) {
+            tm.tm_sec ++;
+        } else
+            return t;
+        t = mktimegm(&tm);
+    }
+    return -1;
 }
 
-static void s3c_rtc_update(struct s3c_rtc_state_s *s)
+static void s3c_rtc_alarm_update(struct s3c_rtc_state_s *s)
 {
-#if 1
-	qemu_get_timedate(&s->tm, 0);
-#else
-    void *ret;
-    time_t ti = s->sec;
-    if (rtc_utc)
-        ret = gmtime_r(&ti, &s->tm);
+    if (s->alarm & (1 << 6))				/* ALMEN */
+        s->alarm_next = s3c_rtc_alarm_match(s, s3c_rtc_now(s));
     else
-        ret = localtime_r(&ti, &s->tm);
-#endif
+        s->alarm_next = -1;
+
+    if (s->alarm_next < 0)
+        qemu_del_timer(s->alarm_timer);
+    else
+        qemu_mod_timer(s->alarm_timer,
+                        s->alarm_next * ticks_per_sec - s->offset);
 }
 
-static inline uint32_t to_bcd(int val)
+static void s3c_rtc_alarm(void *opaque)
 {
-    return ((val / 10) << 4) | (val % 10);
+    struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
+
+    qemu_irq_raise(s->alarm_irq);
+    s3c_rtc_alarm_update(s);
 }
 
-static inline int from_bcd(uint32_t val)
+/* Moves the wall time by DIFF seconds, keeping the sub-second phase */
+static void s3c_rtc_adjust(struct s3c_rtc_state_s *s, int64_t diff)
 {
-    return ((val >> 4) * 10) + (val & 0x0f);
+    s->offset += diff * ticks_per_sec;
+    s3c_rtc_alarm_update(s);
+}
+
+/*
+ * The BCD registers are independent counters on the chip, so a date set
+ * one field at a time may pass through ones that don't exist (e.g. Feb
+ * 29 of a common year before the year is written).  Such fields are
+ * held as written, not normalised, and the clock only moves to them
+ * once they make up a valid date.
+ */
+static void s3c_rtc_set(struct s3c_rtc_state_s *s, struct tm *tm)
+{
+    if (!s3c_rtc_valid(tm)) {
+        s->set = *tm;
+        s->pending = 1;
+        return;
+    }
+
+    s->pending = 0;
+    s3c_rtc_adjust(s, (int64_t) mktimegm(tm) - s3c_rtc_now(s));
+}
+
+/* Jumps the wall time SECONDS forward, posting an alarm that falls in
+ * the skipped interval.  */
+static void s3c_rtc_warp(void *opaque, int seconds)
+{
+    struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
+
+    if (seconds > 0 && s->alarm_next >= 0 &&
+                    s->alarm_next <= s3c_rtc_now(s) + seconds)
+        qemu_irq_raise(s->alarm_irq);
+    s3c_rtc_adjust(s, seconds);
+}
+
+void s3c_rtc_reset(struct s3c_rtc_state_s *s)
+{
+    s->control = 0x00;
+    s->enable = 0;
+    s->tick = 0x00;
+    s->alarm = 0x00;
+    s->almsec = 0x00;
+    s->almmin = 0x00;
+    s->almhour = 0x00;
+    s->almday = 0x01;
+    s->almmon = 0x01;
+    s->almyear = 0x00;
+    s->reset = 0;
+    s3c_rtc_tick_update(s);
+    s3c_rtc_alarm_update(s);
 }
 
 #define S3C_RTC_CON	0x40	/* RTC Control register */
@@ -123,6 +279,7 @@ static inline int from_bcd(uint32_t val)
 static uint32_t s3c_rtc_read(void *opaque, target_phys_addr_t addr)
 {
     struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
+    struct tm tm;
 
     switch (addr) {
     case S3C_RTC_CON:
@@ -150,26 +307,26 @@ static uint32_t s3c_rtc_read(void *opaque, target_phys_addr_t addr)
         return s->reset;
 
     case S3C_RTC_BCDSEC:
-        s3c_rtc_update(s);
-        return to_bcd(s->tm.tm_sec);
+        s3c_rtc_fields(s, &tm);
+        return to_bcd(tm.tm_sec);
     case S3C_RTC_BCDMIN:
-        s3c_rtc_update(s);
-        return to_bcd(s->tm.tm_min);
+        s3c_rtc_fields(s, &tm);
+        return to_bcd(tm.tm_min);
     case S3C_RTC_BCDHOUR:
-        s3c_rtc_update(s);
-        return to_bcd(s->tm.tm_hour);
+        s3c_rtc_fields(s, &tm);
+        return to_bcd(tm.tm_hour);
     case S3C_RTC_BCDDATE:
-        s3c_rtc_update(s);
-        return to_bcd(s->tm.tm_mday);
+        s3c_rtc_fields(s, &tm);
+        return to_bcd(tm.tm_mday);
     case S3C_RTC_BCDDAY:
-        s3c_rtc_update(s);
-        return s->tm.tm_wday;
+        s3c_rtc_time(s, &tm);
+        return (tm.tm_wday + s->wday_delta) % 7;
     case S3C_RTC_BCDMON:
-        s3c_rtc_update(s);
-        return to_bcd(s->tm.tm_mon + 1);
+        s3c_rtc_fields(s, &tm);
+        return to_bcd(tm.tm_mon + 1);
     case S3C_RTC_BCDYEAR:
-        s3c_rtc_update(s);
-        return to_bcd(s->tm.tm_year % 100);
+        s3c_rtc_fields(s, &tm);
+        return to_bcd(tm.tm_year % 100);
     default:
         printf("%s: Bad register 0x%lx\n", __FUNCTION__, (unsigned long)addr);
         break;
@@ -181,7 +338,7 @@ static void s3c_rtc_write(void *opaque, target_phys_addr_t addr,
                 uint32_t value)
 {
     struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
-    int diff;
+    struct tm tm;
 
     switch (addr) {
     case S3C_RTC_CON:
@@ -190,72 +347,83 @@ static void s3c_rtc_write(void *opaque, target_phys_addr_t addr,
         break;
 
     case S3C_RTC_TICNT:
+        /* The tick counter restarts when it's enabled or reloaded */
+        if ((value & (1 << 7)) &&
+                        (!(s->tick & (1 << 7)) || ((value ^ s->tick) & 0x7f)))
+            s->tick_next = qemu_get_clock(vm_clock) +
+                    muldiv64((value & 0x7f) + 1,
+                            ticks_per_sec, S3C_RTC_TICK_FREQ);
         s->tick = value;
-        if (s->tick & (1 << 7))
-            s3c_rtc_tick_mod(s);
+        s3c_rtc_tick_update(s);
         break;
 
     case S3C_RTC_ALM:
         s->alarm = value;
+        s3c_rtc_alarm_update(s);
         break;
     case S3C_RTC_ALMSEC:
         s->almsec = value;
+        s3c_rtc_alarm_update(s);
         break;
     case S3C_RTC_ALMMIN:
         s->almmin = value;
+        s3c_rtc_alarm_update(s);
         break;
     case S3C_RTC_ALMHOUR:
         s->almhour = value;
+        s3c_rtc_alarm_update(s);
         break;
     case S3C_RTC_ALMDATE:
         s->almday = value;
+        s3c_rtc_alarm_update(s);
         break;
     case S3C_RTC_ALMMON:
         s->almmon = value;
+        s3c_rtc_alarm_update(s);
         break;
     case S3C_RTC_ALMYEAR:
         s->almyear = value;
+        s3c_rtc_alarm_update(s);
         break;
 
     case S3C_RTC_RST:
         s->reset = value & 0xf;
         break;
 
-    /* XXX This is not very exact time setting */
     case S3C_RTC_BCDSEC:
-        s3c_rtc_update(s);
-        diff = from_bcd(value) - s->tm.tm_sec;
-        s->sec += diff * 1;
+        s3c_rtc_fields(s, &tm);
+        tm.tm_sec = from_bcd(value);
+        s3c_rtc_set(s, &tm);
         break;
     case S3C_RTC_BCDMIN:
-        s3c_rtc_update(s);
-        diff = from_bcd(value) - s->tm.tm_min;
-        s->sec += diff * 60;
+        s3c_rtc_fields(s, &tm);
+        tm.tm_min = from_bcd(value);
+        s3c_rtc_set(s, &tm);
         break;
     case S3C_RTC_BCDHOUR:
-        s3c_rtc_update(s);
-        diff = from_bcd(value) - s->tm.tm_hour;
-        s->sec += diff * 60 * 60;
+        s3c_rtc_fields(s, &tm);
+        tm.tm_hour = from_bcd(value);
+        s3c_rtc_set(s, &tm);
         break;
     case S3C_RTC_BCDDATE:
-        s3c_rtc_update(s);
-        diff = from_bcd(value) - s->tm.tm_mday;
-        s->sec += diff * 60 * 60 * 24;
+        s3c_rtc_fields(s, &tm);
+        tm.tm_mday = from_bcd(value);
+        s3c_rtc_set(s, &tm);
         break;
     case S3C_RTC_BCDDAY:
-        s3c_rtc_update(s);
-        diff = (value & 7) - s->tm.tm_wday;
-        s->sec += diff * 60 * 60 * 24;
+        /* The day of the week is a counter of its own */
+        s3c_rtc_time(s, &tm);
+        s->wday_delta = ((value & 7) - tm.tm_wday + 7) % 7;
         break;
     case S3C_RTC_BCDMON:
-        s3c_rtc_update(s);
-        diff = from_bcd(value) - s->tm.tm_mon - 1;
-        s->sec += diff * 60 * 60 * 24 * 30;
+        s3c_rtc_fields(s, &tm);
+        tm.tm_mon = from_bcd(value) - 1;
+        s3c_rtc_set(s, &tm);
         break;
     case S3C_RTC_BCDYEAR:
-        s3c_rtc_update(s);
-        diff = from_bcd(value) - (s->tm.tm_year % 100);
-        s->sec += diff * 60 * 60 * 24 * 365;
+        s3c_rtc_fields(s, &tm);
+        tm.tm_year += from_bcd(value) - tm.tm_year % 100;
+        s3c_rtc_set(s, &tm);
         break;
     default:
         printf("%s: Bad register 0x%lx\n", __FUNCTION__, (unsigned long)addr);
@@ -277,7 +445,16 @@ static CPUWriteMemoryFunc *s3c_rtc_writefn[] = {
 static void s3c_rtc_save(QEMUFile *f, void *opaque)
 {
     struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
-    qemu_put_sbe64s(f, &s->next);
+    qemu_put_sbe64s(f, &s->offset);
+    qemu_put_sbe64s(f, &s->tick_next);
+    qemu_put_sbe32s(f, &s->wday_delta);
+    qemu_put_be32(f, s->pending);
+    qemu_put_be32(f, s->set.tm_sec);
+    qemu_put_be32(f, s->set.tm_min);
+    qemu_put_be32(f, s->set.tm_hour);
+    qemu_put_be32(f, s->set.tm_mday);
+    qemu_put_be32(f, s->set.tm_mon);
+    qemu_put_be32(f, s->set.tm_year);
     qemu_put_8s(f, &s->control);
     qemu_put_8s(f, &s->tick);
     qemu_put_8s(f, &s->alarm);
@@ -288,13 +465,32 @@ static void s3c_rtc_save(QEMUFile *f, void *opaque)
     qemu_put_8s(f, &s->almmon);
     qemu_put_8s(f, &s->almyear);
     qemu_put_8s(f, &s->reset);
-    qemu_put_be32s(f, &s->sec);
 }
 
 static int s3c_rtc_load(QEMUFile *f, void *opaque, int version_id)
 {
     struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *) opaque;
-    qemu_get_sbe64s(f, &s->next);
+    uint32_t sec;
+
+    if (version_id >= 1) {
+        qemu_get_sbe64s(f, &s->offset);
+        qemu_get_sbe64s(f, &s->tick_next);
+        qemu_get_sbe32s(f, &s->wday_delta);
+    } else {
+        qemu_get_be64(f);				/* next */
+        s->tick_next = qemu_get_clock(vm_clock);
+        s->wday_delta = 0;
+    }
+    s->pending = 0;
+    if (version_id >= 2) {
+        s->pending = qemu_get_be32(f);
+        s->set.tm_sec = qemu_get_be32(f);
+        s->set.tm_min = qemu_get_be32(f);
+        s->set.tm_hour = qemu_get_be32(f);
+        s->set.tm_mday = qemu_get_be32(f);
+        s->set.tm_mon = qemu_get_be32(f);
+        s->set.tm_year = qemu_get_be32(f);
+    }
     qemu_get_8s(f, &s->control);
     qemu_get_8s(f, &s->tick);
     qemu_get_8s(f, &s->alarm);
@@ -305,34 +501,47 @@ static int s3c_rtc_load(QEMUFile *f, void *opaque, int version_id)
     qemu_get_8s(f, &s->almmon);
     qemu_get_8s(f, &s->almyear);
     qemu_get_8s(f, &s->reset);
-    qemu_get_be32s(f, &s->sec);
+    if (version_id < 1) {
+        qemu_get_be32s(f, &sec);
+        s->offset = sec * ticks_per_sec - qemu_get_clock(vm_clock);
+    }
 
     s->enable = (s->control == 0x1);
-    s3c_rtc_tick_mod(s);
+    s3c_rtc_tick_update(s);
+    s3c_rtc_alarm_update(s);
 
     return 0;
 }
 
-struct s3c_rtc_state_s *s3c_rtc_init(target_phys_addr_t base, qemu_irq irq)
+struct s3c_rtc_state_s *s3c_rtc_init(target_phys_addr_t base,
+                struct s3c_pic_state_s *pic)
 {
     int iomemtype;
+    struct tm tm;
     struct s3c_rtc_state_s *s = (struct s3c_rtc_state_s *)
             qemu_mallocz(sizeof(struct s3c_rtc_state_s));
 
     s->base = base;
-    s->irq = irq;
-    s->timer = qemu_new_timer(vm_clock, s3c_rtc_tick, s);
-    s->hz = qemu_new_timer(rt_clock, s3c_rtc_hz, s);
+    s->pic = pic;
+    s->tick_irq = s3c_pic_get(pic)[S3C_PIC_TICK];
+    s->alarm_irq = s3c_pic_get(pic)[S3C_PIC_RTC];
+    s->tick_timer = qemu_new_timer(vm_clock, s3c_rtc_tick, s);
+    s->alarm_timer = qemu_new_timer(vm_clock, s3c_rtc_alarm, s);
+
+    /* Battery backed, so only set once */
+    qemu_get_timedate(&tm, 0);
+    s->offset = (int64_t) mktimegm(&tm) * ticks_per_sec -
+            qemu_get_clock(vm_clock);
 
     s3c_rtc_reset(s);
-    s->next = qemu_get_clock(rt_clock) + 1000;
-    qemu_mod_timer(s->hz, s->next);
+    s3c_pic_sync_add(pic, s3c_rtc_tick, s);
+    qemu_register_rtc_warp(s3c_rtc_warp, s);
 
     iomemtype = cpu_register_io_memory(0, s3c_rtc_readfn,
                     s3c_rtc_writefn, s);
     cpu_register_physical_memory(s->base, 0xffffff, iomemtype);
 
-    register_savevm("s3c24xx_rtc", 0, 0, s3c_rtc_save, s3c_rtc_load, s);
+    register_savevm("s3c24xx_rtc", 0, 2, s3c_rtc_save, s3c_rtc_load, s);
 
     return s;
 }
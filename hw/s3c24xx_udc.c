@@ -18,6 +18,7 @@ struct s3c_udc_state_s {
     USBDevice dev;
     qemu_irq irq;
     qemu_irq *dma;
+    USBPacket *handling;	/* Token being handled, may complete in place */
 
     /* Use FIFOs big enough to hold entire packets, just don't report
      * lengths greater than 16 and 64 bytes for EP0 and EP1-4 respectively.  */
@@ -31,7 +32,9 @@ struct s3c_udc_state_s {
     } ep0;
 
 #define S3C_EPS 5
-    struct {
+    struct s3c_udc_ep_s {
+        struct s3c_udc_state_s *s;
+        int num;
         int start, len;
         uint8_t fifo[S3C_USB_FIFO_LEN];
         USBPacket *packet;
@@ -57,6 +60,10 @@ struct s3c_udc_state_s {
     uint8_t address;
 };
 
+static const int s3c_udc_ep_drq[S3C_EPS - 1] = {
+    S3C_RQ_USB_EP1, S3C_RQ_USB_EP2, S3C_RQ_USB_EP3, S3C_RQ_USB_EP4,
+};
+
 void s3c_udc_reset(struct s3c_udc_state_s *s)
 {
     int i;
@@ -84,6 +91,7 @@ void s3c_udc_reset(struct s3c_udc_state_s *s)
         s->ep1[i].fifo_cnt = 0x00;
         s->ep1[i].dma_size = 0;
         s->ep1[i].packet = 0;
+        qemu_irq_lower(s->dma[s3c_udc_ep_drq[i]]);
     }
 }
 
@@ -112,20 +120,82 @@ static void s3c_udc_queue_packet(uint8_t *dst, uint8_t *src,
     }
 }
 
-static void s3c_udc_dequeue_packet(uint8_t *dst, uint8_t *src,
-                int *fstart, int *flen)
+static void s3c_udc_fifo_read(uint8_t *dst, uint8_t *src,
+                int *fstart, int *flen, int len)
 {
     int chunk;
-    while (*flen) {
-        chunk = MIN(*flen, S3C_USB_FIFO_LEN - *fstart);
+    *flen -= len;
+    while (len) {
+        chunk = MIN(len, S3C_USB_FIFO_LEN - *fstart);
         memcpy(dst, src + *fstart, chunk);
-        *flen -= chunk;
+        len -= chunk;
         dst += chunk;
         *fstart += chunk;
         *fstart &= S3C_USB_FIFO_LEN - 1;
     }
 }
 
+static void s3c_udc_dequeue_packet(uint8_t *dst, uint8_t *src,
+                int *fstart, int *flen)
+{
+    s3c_udc_fifo_read(dst, src, fstart, flen, *flen);
+}
+
+/* The endpoint asks the DMA controller for service while it has a
+ * packet to fill (IN) or unread data in the FIFO (OUT).  */
+static void s3c_udc_ep1_dreq(struct s3c_udc_state_s *s, int ep)
+{
+    int req = 0;
+
+    if (s->ep1[ep].control & (1 << 0)) {		/* DMA_MODE_EN */
+        if (s->ep1[ep].in_csr[1] & (1 << 5))		/* MODE_IN */
+            req = s->ep1[ep].packet != 0;
+        else
+            req = s->ep1[ep].len > 0;
+    }
+    qemu_set_irq(s->dma[s3c_udc_ep_drq[ep]], req);
+}
+
+static void s3c_udc_cancel(USBPacket *packet, void *opaque)
+{
+    struct s3c_udc_state_s *s = (struct s3c_udc_state_s *) opaque;
+    int i;
+
+    if (s->ep0.packet == packet)
+        s->ep0.packet = 0;
+    for (i = 0; i < S3C_EPS - 1; i ++)
+        if (s->ep1[i].packet == packet) {
+            s->ep1[i].packet = 0;
+            s->ep1[i].packet_len = 0;
+            s3c_udc_ep1_dreq(s, i);
+        }
+}
+
+static void s3c_udc_complete(struct s3c_udc_state_s *s, USBPacket *packet)
+{
+    /* A DMA triggered from s3c_udc_handle_packet() can finish the
+     * transfer before the token has been deferred.  */
+    if (s->handling == packet)
+        s->handling = 0;
+    else
+        usb_packet_complete(packet);
+}
+
+/* An OUT transfer completes once the guest has emptied the FIFO, so that
+ * the host doesn't send the next one on top of unread data.  */
+static void s3c_udc_ep1_out_done(struct s3c_udc_state_s *s, int ep)
+{
+    USBPacket *packet = s->ep1[ep].packet;
+
+    if (s->ep1[ep].in_csr[1] & (1 << 5))		/* MODE_IN */
+        return;
+    s3c_udc_ep1_dreq(s, ep);
+    if (packet && !s->ep1[ep].len) {
+        s->ep1[ep].packet = 0;
+        s3c_udc_complete(s, packet);
+    }
+}
+
 static void s3c_udc_ep0_rdy(struct s3c_udc_state_s *s, uint8_t value)
 {
     USBPacket *packet = s->ep0.packet;
@@ -178,10 +248,61 @@ static void s3c_udc_ep1_rdy(struct s3c_udc_state_s *s, int ep, uint8_t value)
         /* Signal completion of IN token */
         s->ep1[ep].packet = 0;
         s->ep1[ep].packet_len = 0;
+        s3c_udc_ep1_dreq(s, ep);
         packet->complete_cb(packet, packet->complete_opaque);
     }
 }
 
+/* DMA from the EPn_FIFO register straight into guest memory (OUT) */
+static int s3c_udc_dma_read(void *opaque, uint8_t *buf, int len)
+{
+    struct s3c_udc_ep_s *e = (struct s3c_udc_ep_s *) opaque;
+    struct s3c_udc_state_s *s = e->s;
+
+    if (e->in_csr[1] & (1 << 5))			/* MODE_IN */
+        return 0;
+    len = MIN(len, e->len);
+    if (!len)
+        return 0;
+
+    s3c_udc_fifo_read(buf, e->fifo, &e->start, &e->len, len);
+    if (!e->len) {
+        e->out_csr[0] &= ~(1 << 0);			/* OUT_PKT_READY */
+        s3c_udc_ep1_out_done(s, e->num);
+    }
+    return len;
+}
+
+/* DMA from guest memory into the EPn_FIFO register (IN).  A packet is
+ * complete when the host's buffer is full or a short packet (not a
+ * multiple of 64 bytes) has been written, same as for the CPU path.  */
+static int s3c_udc_dma_write(void *opaque, const uint8_t *buf, int len)
+{
+    struct s3c_udc_ep_s *e = (struct s3c_udc_ep_s *) opaque;
+    struct s3c_udc_state_s *s = e->s;
+    USBPacket *packet = e->packet;
+
+    if (!(e->in_csr[1] & (1 << 5)) || !packet)		/* MODE_IN */
+        return 0;
+    len = MIN(len, MIN(packet->len - e->len, S3C_USB_FIFO_LEN - e->len));
+    if (len <= 0)
+        return 0;
+
+    s3c_udc_queue_packet(e->fifo, (uint8_t *) buf, e->start, &e->len, len);
+    if (e->len < packet->len && !((e->len - e->packet_len) & 63)) {
+        e->packet_len = e->len;
+        return len;
+    }
+
+    packet->len = e->len;
+    s3c_udc_dequeue_packet(packet->data, e->fifo, &e->start, &e->len);
+    e->packet = 0;
+    e->packet_len = 0;
+    s3c_udc_ep1_dreq(s, e->num);
+    s3c_udc_complete(s, packet);
+    return len;
+}
+
 #define S3C_FUNC_ADDR	0x140	/* Function address register */
 #define S3C_PWR		0x144	/* Power management register */
 #define S3C_EP_INT	0x148	/* Endpoint interrupt register */
@@ -287,6 +408,7 @@ static uint32_t s3c_udc_read(void *opaque, target_phys_addr_t addr)
         if (s->ep1[ep].out_csr[1] & (1 << 7))		/* AUTO_CLR */
             if (s->ep1[ep].len <= 0) {
                 s->ep1[ep].out_csr[0] &= ~(1 << 0);	/* OUT_PKT_READY */
+                s3c_udc_ep1_out_done(s, ep);
             }
         return ret;
     case S3C_MAXP:
@@ -428,6 +550,8 @@ static void s3c_udc_write(void *opaque, target_phys_addr_t addr,
         }
         s->ep1[s->index - 1].out_csr[0] = value &
                 (0xa0 | (s->ep1[s->index - 1].out_csr[0] & 0x41));
+        if (!(s->ep1[s->index - 1].out_csr[0] & (1 << 0)))	/* OUT_PKT_R */
+            s3c_udc_ep1_out_done(s, s->index - 1);
         break;
 
     case S3C_OUT_CSR2:
@@ -473,6 +597,7 @@ static void s3c_udc_write(void *opaque, target_phys_addr_t addr,
         if (!ep --)
             goto bad_reg;
         s->ep1[ep].control = value;
+        s3c_udc_ep1_dreq(s, ep);
         break;
 
     case S3C_EP_DMA_UNIT:
@@ -592,6 +717,9 @@ static int s3c_udc_handle_packet(USBDevice *dev, USBPacket *p)
     struct s3c_udc_state_s *s = (struct s3c_udc_state_s *) dev->opaque;
     int ep;
     int ret = 0;
+
+    if (unlikely(p->devep >= S3C_EPS))
+        return USB_RET_STALL;
     s->power &= ~(1 << 3);				/* USB_RESET */
 
     switch (p->pid) {
@@ -655,10 +783,18 @@ static int s3c_udc_handle_packet(USBDevice *dev, USBPacket *p)
                 s->ep1[ep].in_csr[0] &= ~(1 << 3);	/* FIFO_FLUSH */
                 s3c_udc_interrupt(s, p->devep);
             }
-            /* TODO: DMA */
             s->ep1[ep].packet = p;
+            s->handling = p;
+            s3c_udc_ep1_dreq(s, ep);
+            if (!s->handling) {
+                s->frame ++;
+                ret = p->len;
+                break;
+            }
+            s->handling = 0;
         }
         s->frame ++;
+        usb_defer_packet(p, s3c_udc_cancel, s);
         ret = USB_RET_ASYNC;
         break;
     case USB_TOKEN_OUT:
@@ -699,13 +835,22 @@ static int s3c_udc_handle_packet(USBDevice *dev, USBPacket *p)
                 s->ep1[ep].out_csr[0] |= 1 << 0;	/* OUT_PKT_RDY */
                 s3c_udc_interrupt(s, p->devep);
             }
-            /* TODO: DMA */
+            /* Complete only once the guest, or the DMA, has drained the
+             * FIFO so the host can't overrun it.  */
+            if (s->ep1[ep].len) {
+                s->ep1[ep].packet = p;
+                s->handling = p;
+                s3c_udc_ep1_dreq(s, ep);
+                if (s->handling) {
+                    s->handling = 0;
+                    usb_defer_packet(p, s3c_udc_cancel, s);
+                    ret = USB_RET_ASYNC;
+                }
+            }
         }
-        /* Perhaps it is a good idea to return USB_RET_ASYNC here and in
-         * USB_TOKEN_SETUP and trigger completion only after OUT_PKT_RDY
-         * condition is serviced by the guest to avoid potential overruns
-         * and so that the host can know about timeouts (seems there's no
-         * way to indicate other errors asynchronously).  */
+        /* Perhaps it is a good idea to return USB_RET_ASYNC in
+         * USB_TOKEN_SETUP too and trigger completion only after
+         * OUT_PKT_RDY condition is serviced by the guest.  */
         break;
     default:
     fail:
@@ -733,9 +878,9 @@ static void s3c_udc_handle_destroy(USBDevice *dev)
 }
 
 struct s3c_udc_state_s *s3c_udc_init(target_phys_addr_t base,
-                qemu_irq irq, qemu_irq *dma)
+                qemu_irq irq, qemu_irq *dma, struct s3c_dma_state_s *dmac)
 {
-    int iomemtype;
+    int i, iomemtype;
     struct s3c_udc_state_s *s = (struct s3c_udc_state_s *)
             qemu_mallocz(sizeof(struct s3c_udc_state_s));
 
@@ -754,10 +899,17 @@ struct s3c_udc_state_s *s3c_udc_init(target_phys_addr_t base,
                     s3c_udc_writefn, s);
     cpu_register_physical_memory(s->base, 0xffffff, iomemtype);
 
+    /* Bulk endpoints can be streamed by the DMA one transfer at a time */
+    for (i = 0; i < S3C_EPS - 1; i ++) {
+        s->ep1[i].s = s;
+        s->ep1[i].num = i;
+        s3c_dma_port_add(dmac, s->base + S3C_EP1_FIFO + (i << 2), 1,
+                        s3c_udc_dma_read, s3c_udc_dma_write, &s->ep1[i]);
+    }
+
     register_savevm("s3c24xx_udc", 0, 0, s3c_udc_save, s3c_udc_load, s);
 
-    // TODO import usb gadget code from openmoko
-//    qemu_register_usb_gadget(&s->dev);
+    qemu_register_usb_gadget(&s->dev, S3C_EPS);
 
     return s;
 }
@@ -31,6 +31,8 @@
 
 #include "hw.h"
 #include "block.h"
+#include "qemu-timer.h"
+#include "qemu-aio.h"
 #include "sd.h"
 
 //#define DEBUG_SD 1
@@ -100,9 +102,40 @@ struct SDState {
     BlockDriverState *bdrv;
     uint8_t *buf;
 
+    /* Multi-block transfers go to the block layer in runs of blocks */
+    uint8_t *rabuf;		/* CMD11/CMD18 read-ahead */
+    uint32_t ra_sector;
+    int ra_count;
+    int ra_failed;		/* Serve one block, then read again */
+    uint8_t *wbuf;		/* Gathered writes */
+    uint8_t *wbuf_io;		/* Gathered writes going out */
+    uint32_t wb_start;
+    int wb_len;
+    int blk_count;		/* Blocks the host announced, 0 if unknown */
+    int blk_left;
+
+    /* Block I/O goes through the AIO interface and the card holds DAT0
+     * low (busy) while a request is in flight */
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int aio_busy;
+    int aio_write;
+    uint32_t aio_sector;
+    int aio_count;
+    qemu_irq busy_cb;
+    QEMUTimer *busy_timer;
+
     int enable;
 };
 
+#define SD_MULTI_SECTORS	128
+
+static void sd_blk_flush(SDState *sd);
+static void sd_blk_wait(SDState *sd);
+static void sd_blk_busy_update(void *opaque);
+static int sd_blk_prefetch(SDState *sd, uint32_t addr, uint32_t len,
+                int multi);
+
 static void sd_set_status(SDState *sd)
 {
     switch (sd->state) {
@@ -379,6 +412,8 @@ static void sd_reset(SDState *sd, BlockDriverState *bdrv)
 
     sect = (size >> (HWBLOCK_SHIFT + SECTOR_SHIFT + WPGROUP_SHIFT)) + 1;
 
+    sd_blk_wait(sd);
+
     sd->state = sd_idle_state;
     sd->rca = 0x0000;
     sd_set_ocr(sd);
@@ -400,6 +435,10 @@ static void sd_reset(SDState *sd, BlockDriverState *bdrv)
     sd->size = size;
     sd->blk_len = 0x200;
     sd->pwd_len = 0;
+    sd->ra_count = 0;
+    sd->ra_failed = 0;
+    sd->wb_len = 0;
+    sd->blk_left = 0;
 }
 
 static void sd_cardchange(void *opaque)
@@ -422,6 +461,10 @@ SDState *sd_init(BlockDriverState *bs, int is_spi)
 
     sd = (SDState *) qemu_mallocz(sizeof(SDState));
     sd->buf = qemu_memalign(512, 512);
+    sd->rabuf = qemu_memalign(512, SD_MULTI_SECTORS << 9);
+    sd->wbuf = qemu_memalign(512, SD_MULTI_SECTORS << 9);
+    sd->wbuf_io = qemu_memalign(512, SD_MULTI_SECTORS << 9);
+    sd->busy_timer = qemu_new_timer(vm_clock, sd_blk_busy_update, sd);
     sd->spi = is_spi;
     sd->enable = 1;
     sd_reset(sd, bs);
@@ -439,6 +482,19 @@ void sd_set_cb(SDState *sd, qemu_irq readonly, qemu_irq insert)
     qemu_set_irq(insert, bdrv_is_inserted(sd->bdrv));
 }
 
+/* BUSY is raised while the card waits for the host and lowered, from the
+ * main loop, once it can move data again.  */
+void sd_set_busy_cb(SDState *sd, qemu_irq busy)
+{
+    sd->busy_cb = busy;
+    qemu_set_irq(busy, sd->aio_busy);
+}
+
+int sd_busy(SDState *sd)
+{
+    return sd->aio_busy;
+}
+
 static void sd_erase(SDState *sd)
 {
     int i, start, end;
@@ -855,6 +911,8 @@ static sd_rsp_type_t sd_normal_command(SDState *sd,
 
             if (sd->data_start + sd->blk_len > sd->size)
                 sd->card_status |= ADDRESS_ERROR;
+            else
+                sd_blk_prefetch(sd, sd->data_start, sd->blk_len, 0);
             return sd_r1;
 
         default:
@@ -868,9 +926,12 @@ static sd_rsp_type_t sd_normal_command(SDState *sd,
             sd->state = sd_sendingdata_state;
             sd->data_start = req.arg;
             sd->data_offset = 0;
+            sd->blk_left = sd->blk_count;
 
             if (sd->data_start + sd->blk_len > sd->size)
                 sd->card_status |= ADDRESS_ERROR;
+            else
+                sd_blk_prefetch(sd, sd->data_start, sd->blk_len, 1);
             return sd_r1;
 
         default:
@@ -917,6 +978,7 @@ static sd_rsp_type_t sd_normal_command(SDState *sd,
             sd->data_start = req.arg;
             sd->data_offset = 0;
             sd->blk_written = 0;
+            sd->blk_left = sd->blk_count;
 
             if (sd->data_start + sd->blk_len > sd->size)
                 sd->card_status |= ADDRESS_ERROR;
@@ -1243,6 +1305,9 @@ int sd_do_command(SDState *sd, SDRequest *req,
         return 0;
     }
 
+    /* Any command ends a run of gathered CMD25 blocks */
+    sd_blk_flush(sd);
+
     sd->card_status &= ~CARD_STATUS_B;
     sd_set_status(sd);
 
@@ -1322,11 +1387,152 @@ int sd_do_command(SDState *sd, SDRequest *req,
     return rsplen;
 }
 
+/* Completion of the request started by sd_blk_aio().  The host sees the
+ * card go ready from the main loop rather than from here, which may be
+ * deep inside a qemu_aio_wait() on behalf of the host itself.  */
+static void sd_blk_aio_cb(void *opaque, int ret)
+{
+    SDState *sd = opaque;
+
+    sd->aio_busy = 0;
+    if (ret < 0)
+        fprintf(stderr, "sd_blk_%s: %s error on host side\n",
+                        sd->aio_write ? "write" : "read",
+                        sd->aio_write ? "write" : "read");
+    /* On a read error the block still goes out, like it always did,
+     * but the range isn't kept for the blocks that follow */
+    if (!sd->aio_write) {
+        sd->ra_sector = sd->aio_sector;
+        sd->ra_count = sd->aio_count;
+        sd->ra_failed = ret < 0;
+    }
+    qemu_mod_timer(sd->busy_timer, qemu_get_clock(vm_clock));
+}
+
+static void sd_blk_busy_update(void *opaque)
+{
+    SDState *sd = opaque;
+
+    qemu_set_irq(sd->busy_cb, sd->aio_busy);
+}
+
+/* Only one request is in flight at any time */
+static void sd_blk_aio(SDState *sd, int write,
+                uint32_t sector, uint8_t *buf, int count)
+{
+    BlockDriverAIOCB *acb;
+
+    sd->iov.iov_base = buf;
+    sd->iov.iov_len = count << 9;
+    qemu_iovec_init_external(&sd->qiov, &sd->iov, 1);
+    sd->aio_write = write;
+    sd->aio_sector = sector;
+    sd->aio_count = count;
+    sd->aio_busy = 1;
+    qemu_set_irq(sd->busy_cb, 1);
+
+    if (write)
+        acb = bdrv_aio_writev(sd->bdrv, sector, &sd->qiov, count,
+                        sd_blk_aio_cb, sd);
+    else
+        acb = bdrv_aio_readv(sd->bdrv, sector, &sd->qiov, count,
+                        sd_blk_aio_cb, sd);
+    if (!acb)
+        sd_blk_aio_cb(sd, -EIO);
+}
+
+static void sd_blk_wait(SDState *sd)
+{
+    while (sd->aio_busy)
+        qemu_aio_wait();
+}
+
+static int sd_blk_cached(SDState *sd, uint32_t addr, uint32_t len)
+{
+    uint32_t start = sd->ra_sector << 9;
+
+    return sd->ra_count && addr >= start &&
+            addr + len <= start + (sd->ra_count << 9);
+}
+
+/*
+ * Start loading the read-ahead buffer with the range, and for multi-block
+ * reads with as many of the blocks announced by the host as fit, or the
+ * whole buffer if the host did not say how many it wants.  Returns zero
+ * if the range can't go through the buffer and needs a synchronous read.
+ */
+static int sd_blk_prefetch(SDState *sd, uint32_t addr, uint32_t len,
+                int multi)
+{
+    uint32_t sector = addr >> 9;
+    uint32_t last = sd->size >> 9;
+    int count, need;
+
+    if (!sd->bdrv)
+        return 0;
+    if (sd_blk_cached(sd, addr, len))
+        return 1;
+
+    need = ((addr & 511) + len + 511) >> 9;
+    count = need;
+    if (multi) {
+        count = SD_MULTI_SECTORS;
+        if (sd->blk_left)
+            count = MIN(count, sd->blk_left * ((sd->blk_len + 511) >> 9));
+        count = MAX(count, need);
+        if (sector + count > last)
+            count = need;
+    }
+    if (count > SD_MULTI_SECTORS || sector + count > last)
+        return 0;
+
+    if (!sd->aio_busy) {
+        sd->ra_count = 0;
+        sd_blk_aio(sd, 0, sector, sd->rabuf, count);
+    }
+    return 1;
+}
+
+/* Non-zero if the block at data_start can be loaded without waiting */
+static int sd_blk_read_ready(SDState *sd)
+{
+    uint32_t addr = sd->data_start;
+
+    if (sd_blk_cached(sd, addr, sd->blk_len))
+        return 1;
+    if (!sd_blk_prefetch(sd, addr, sd->blk_len, sd->current_cmd != 17))
+        return !sd->aio_busy;
+    return 0;
+}
+
 /* No real need for 64 bit addresses here */
-static void sd_blk_read(SDState *sd, uint32_t addr, uint32_t len)
+static void sd_blk_read(SDState *sd, uint32_t addr, uint32_t len, int multi)
 {
     uint32_t end = addr + len;
 
+    if (!sd_blk_cached(sd, addr, len)) {
+        sd_blk_wait(sd);
+        if (sd_blk_prefetch(sd, addr, len, multi))
+            sd_blk_wait(sd);
+    }
+    if (sd_blk_cached(sd, addr, len)) {
+        memcpy(sd->data, sd->rabuf + addr - (sd->ra_sector << 9), len);
+        if (multi && sd->blk_left)
+            sd->blk_left --;
+        if (sd->ra_failed) {
+            sd->ra_count = 0;
+            sd->ra_failed = 0;
+        }
+
+        /* sd->data holds the block now, the buffer can be refilled while
+         * the host drains it */
+        if (multi && (sd->blk_left || !sd->blk_count))
+            sd_blk_prefetch(sd, end, sd->blk_len, 1);
+        return;
+    }
+
+    if (multi && sd->blk_left)
+        sd->blk_left --;
     if (!sd->bdrv || bdrv_read(sd->bdrv, addr >> 9, sd->buf, 1) == -1) {
         fprintf(stderr, "sd_blk_read: read error on host side\n");
         return;
@@ -1348,6 +1554,10 @@ static void sd_blk_write(SDState *sd, uint32_t addr, uint32_t len)
 {
     uint32_t end = addr + len;
 
+    sd_blk_flush(sd);
+    sd_blk_wait(sd);
+    sd->ra_count = 0;
+
     if ((addr & 511) || len < 512)
         if (!sd->bdrv || bdrv_read(sd->bdrv, addr >> 9, sd->buf, 1) == -1) {
             fprintf(stderr, "sd_blk_write: read error on host side\n");
@@ -1375,8 +1585,73 @@ static void sd_blk_write(SDState *sd, uint32_t addr, uint32_t len)
     }
 }
 
-#define BLK_READ_BLOCK(a, len)	sd_blk_read(sd, a, len)
-#define BLK_WRITE_BLOCK(a, len)	sd_blk_write(sd, a, len)
+/* Start writing out the blocks gathered so far with a single request,
+ * gathering goes on in the other buffer meanwhile */
+static void sd_blk_flush(SDState *sd)
+{
+    uint8_t *buf = sd->wbuf;
+    int len = sd->wb_len;
+
+    if (!len)
+        return;
+    sd_blk_wait(sd);
+    sd->wb_len = 0;
+    sd->ra_count = 0;
+    sd->wbuf = sd->wbuf_io;
+    sd->wbuf_io = buf;
+
+    if (!sd->bdrv) {
+        fprintf(stderr, "sd_blk_write: write error on host side\n");
+        return;
+    }
+    sd_blk_aio(sd, 1, sd->wb_start >> 9, buf, len >> 9);
+}
+
+/*
+ * Sector aligned blocks are gathered.  A single block write goes out
+ * straight away, CMD25 blocks when the buffer is full, when the number
+ * of blocks announced by the host is reached, or when the next command
+ * arrives.
+ */
+static void sd_blk_write_gather(SDState *sd, uint32_t addr, uint32_t len,
+                int multi)
+{
+    if ((addr & 511) || len != 512) {
+        sd_blk_write(sd, addr, len);
+        return;
+    }
+
+    if (sd->wb_len && addr != sd->wb_start + sd->wb_len)
+        sd_blk_flush(sd);
+    if (!sd->wb_len)
+        sd->wb_start = addr;
+    memcpy(sd->wbuf + sd->wb_len, sd->data, len);
+    sd->wb_len += len;
+
+    if (!multi || (sd->blk_left && !-- sd->blk_left))
+        sd_blk_flush(sd);
+    else if (sd->wb_len >= (SD_MULTI_SECTORS << 9))
+        sd_blk_flush(sd);
+}
+
+/* Non-zero if the block being received can be committed without waiting */
+static int sd_blk_write_ready(SDState *sd)
+{
+    if (!sd->aio_busy)
+        return 1;
+    if ((sd->data_start & 511) || sd->blk_len != 512 ||
+                    sd->current_cmd != 25)
+        return 0;
+    if (sd->wb_len && sd->data_start != sd->wb_start + sd->wb_len)
+        return 0;
+    return sd->blk_left != 1 &&
+            sd->wb_len + 512 < (SD_MULTI_SECTORS << 9);
+}
+
+#define BLK_READ_BLOCK(a, len)	sd_blk_read(sd, a, len, 0)
+#define BLK_READ_MULTI(a, len)	sd_blk_read(sd, a, len, 1)
+#define BLK_WRITE_BLOCK(a, len)	sd_blk_write_gather(sd, a, len, 0)
+#define BLK_WRITE_MULTI(a, len)	sd_blk_write_gather(sd, a, len, 1)
 #define APP_READ_BLOCK(a, len)	memset(sd->data, 0xec, len)
 #define APP_WRITE_BLOCK(a, len)
 
@@ -1414,7 +1689,7 @@ void sd_write_data(SDState *sd, uint8_t value)
         if (sd->data_offset >= sd->blk_len) {
             /* TODO: Check CRC before committing */
             sd->state = sd_programming_state;
-            BLK_WRITE_BLOCK(sd->data_start, sd->data_offset);
+            BLK_WRITE_MULTI(sd->data_start, sd->data_offset);
             sd->blk_written ++;
             sd->data_start += sd->blk_len;
             sd->data_offset = 0;
@@ -1535,7 +1810,7 @@ uint8_t sd_read_data(SDState *sd)
 
     case 11:	/* CMD11:  READ_DAT_UNTIL_STOP */
         if (sd->data_offset == 0)
-            BLK_READ_BLOCK(sd->data_start, sd->blk_len);
+            BLK_READ_MULTI(sd->data_start, sd->blk_len);
         ret = sd->data[sd->data_offset ++];
 
         if (sd->data_offset >= sd->blk_len) {
@@ -1566,7 +1841,7 @@ uint8_t sd_read_data(SDState *sd)
 
     case 18:	/* CMD18:  READ_MULTIPLE_BLOCK */
         if (sd->data_offset == 0)
-            BLK_READ_BLOCK(sd->data_start, sd->blk_len);
+            BLK_READ_MULTI(sd->data_start, sd->blk_len);
         ret = sd->data[sd->data_offset ++];
 
         if (sd->data_offset >= sd->blk_len) {
@@ -1617,6 +1892,92 @@ uint8_t sd_read_data(SDState *sd)
     return ret;
 }
 
+static inline int sd_block_cmd(SDState *sd, int state)
+{
+    if (!sd->bdrv || !bdrv_is_inserted(sd->bdrv) || !sd->enable ||
+                    sd->state != state ||
+                    (sd->card_status & (ADDRESS_ERROR | WP_VIOLATION)))
+        return 0;
+
+    switch (sd->current_cmd) {
+    case 11:	/* CMD11:  READ_DAT_UNTIL_STOP */
+    case 17:	/* CMD17:  READ_SINGLE_BLOCK */
+    case 18:	/* CMD18:  READ_MULTIPLE_BLOCK */
+        return state == sd_sendingdata_state;
+    case 24:	/* CMD24:  WRITE_SINGLE_BLOCK */
+    case 25:	/* CMD25:  WRITE_MULTIPLE_BLOCK */
+        return state == sd_receivingdata_state;
+    }
+    return 0;
+}
+
+/*
+ * Same as LEN calls to sd_read_data.  For block reads the body of each
+ * block is copied in one go, the first and last byte still go through
+ * sd_read_data so that block loading and state changes happen there.
+ * Returns the number of bytes read, which is short if the card has to
+ * wait for the host before it can send the next block.
+ */
+int sd_read_data_block(SDState *sd, uint8_t *buf, int len)
+{
+    uint8_t *start = buf;
+    int n;
+
+    while (len > 0) {
+        if (sd_block_cmd(sd, sd_sendingdata_state)) {
+            if (!sd->data_offset && !sd_blk_read_ready(sd))
+                break;
+            n = MIN(len, sd->blk_len - sd->data_offset - 1);
+            if (sd->data_offset && n > 0) {
+                memcpy(buf, sd->data + sd->data_offset, n);
+                sd->data_offset += n;
+                buf += n;
+                len -= n;
+                if (!len)
+                    break;
+            }
+        }
+
+        *buf ++ = sd_read_data(sd);
+        len --;
+    }
+    return buf - start;
+}
+
+/* Same as LEN calls to sd_write_data, returns the number of bytes taken
+ * which is short if the card is busy and can't accept a whole block */
+int sd_write_data_block(SDState *sd, const uint8_t *buf, int len)
+{
+    const uint8_t *start = buf;
+    int n;
+
+    while (len > 0) {
+        if (sd_block_cmd(sd, sd_receivingdata_state)) {
+            n = MIN(len - 1, sd->blk_len - sd->data_offset - 1);
+            if (n > 0) {
+                memcpy(sd->data + sd->data_offset, buf, n);
+                sd->data_offset += n;
+                buf += n;
+                len -= n;
+            }
+            if (sd->data_offset == sd->blk_len - 1 && !sd_blk_write_ready(sd))
+                break;
+        }
+
+        sd_write_data(sd, *buf ++);
+        len --;
+    }
+    return buf - start;
+}
+
+/* Number of blocks the host intends to move with the next multi-block
+ * command, used to size read-ahead and write gathering.  0 if unknown.  */
+void sd_set_block_count(SDState *sd, int blocks)
+{
+    sd->blk_count = blocks;
+    sd->blk_left = blocks;
+}
+
 int sd_data_ready(SDState *sd)
 {
     return sd->state == sd_sendingdata_state;
@@ -72,7 +72,12 @@ int sd_do_command(SDState *sd, SDRequest *req,
                   uint8_t *response);
 void sd_write_data(SDState *sd, uint8_t value);
 uint8_t sd_read_data(SDState *sd);
+int sd_write_data_block(SDState *sd, const uint8_t *buf, int len);
+int sd_read_data_block(SDState *sd, uint8_t *buf, int len);
+void sd_set_block_count(SDState *sd, int blocks);
 void sd_set_cb(SDState *sd, qemu_irq readonly, qemu_irq insert);
+void sd_set_busy_cb(SDState *sd, qemu_irq busy);
+int sd_busy(SDState *sd);
 int sd_data_ready(SDState *sd);
 void sd_enable(SDState *sd, int enable);
 
@@ -0,0 +1,337 @@
+/*
+ * USB gadget bridge: lets a program outside of QEMU act as the USB host
+ * of an emulated device controller (UDC) through a character device,
+ * usually a Unix socket.
+ *
+ * This code is licenced under the GPL.
+ */
+
+/*
+ * All messages start with a 12 byte header, fields in little-endian:
+ *
+ *   uint8_t  type      USB_GADGET_*
+ *   uint8_t  ep        endpoint number
+ *   uint16_t tag       chosen by the host, echoed in the ACK
+ *   uint32_t len       bytes of payload following the header
+ *   int32_t  status    ACK only: transferred length or USB_RET_*
+ *
+ * The host sends SETUP (8 byte payload), OUT (data payload) and IN
+ * (len is the size of the host buffer, no payload) tokens and gets an
+ * ACK with the same tag for each, carrying the data for IN tokens.
+ * Tokens are handled in order for every endpoint, but the host may
+ * queue many of them at once, in a single write, and ACKs that become
+ * ready together are written back in a single batch.  Up to
+ * USB_GADGET_QUEUE tokens may wait per endpoint, further ones are acked
+ * with USB_RET_NAK, tokens for endpoints the device doesn't have with
+ * USB_RET_STALL.  A new connection attaches and resets the gadget,
+ * RESET does the same at any time.
+ */
+
+#include "qemu-common.h"
+#include "usb.h"
+#include "qemu-char.h"
+#include "sysemu.h"
+
+//#define DEBUG_GADGET
+
+#ifdef DEBUG_GADGET
+#define DPRINTF(fmt, ...) \
+do { printf("usb-gadget: " fmt , ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) do {} while(0)
+#endif
+
+#define USB_GADGET_RESET	0
+#define USB_GADGET_SETUP	1
+#define USB_GADGET_IN		2
+#define USB_GADGET_OUT		3
+#define USB_GADGET_ACK		4
+
+#define USB_GADGET_HDR		12
+#define USB_GADGET_MAX_LEN	(64 * 1024)
+#define USB_GADGET_EPS		16
+#define USB_GADGET_QUEUE	32	/* Tokens waiting per endpoint */
+
+typedef struct USBGadgetReq {
+    USBPacket p;
+    struct USBGadgetState *s;
+    struct USBGadgetReq *next;
+    int type;
+    int ep;
+    int tag;
+    int len;
+    uint8_t data[0];
+} USBGadgetReq;
+
+typedef struct USBGadgetState {
+    USBDevice *dev;
+    CharDriverState *chr;
+    QEMUBH *flush_bh;
+
+    /* Tokens waiting for each endpoint, the head one is in progress */
+    USBGadgetReq *queue[USB_GADGET_EPS];
+    int queued[USB_GADGET_EPS];
+    int busy[USB_GADGET_EPS];
+    int eps;			/* Endpoints the device has */
+
+    uint8_t hdr[USB_GADGET_HDR];
+    int hdr_len;
+    USBGadgetReq *rx;		/* Token whose payload is being received */
+    int rx_len;
+
+    uint8_t *tx;		/* ACKs not yet written to the host */
+    int tx_len;
+    int tx_size;
+} USBGadgetState;
+
+static void usb_gadget_dispatch(USBGadgetState *s, int ep);
+
+static void usb_gadget_put(USBGadgetState *s, const uint8_t *buf, int len)
+{
+    if (s->tx_len + len > s->tx_size) {
+        s->tx_size = MAX(s->tx_size * 2, s->tx_len + len);
+        s->tx = qemu_realloc(s->tx, s->tx_size);
+    }
+    memcpy(s->tx + s->tx_len, buf, len);
+    s->tx_len += len;
+}
+
+static void usb_gadget_flush(void *opaque)
+{
+    USBGadgetState *s = (USBGadgetState *) opaque;
+
+    if (s->tx_len)
+        qemu_chr_write(s->chr, s->tx, s->tx_len);
+    s->tx_len = 0;
+}
+
+static void usb_gadget_ack(USBGadgetState *s, USBGadgetReq *req, int ret)
+{
+    uint8_t hdr[USB_GADGET_HDR];
+    int len = 0;
+
+    if (ret >= 0) {
+        if (req->type == USB_GADGET_IN)
+            len = ret;
+        else
+            ret = req->len;
+    }
+
+    hdr[0] = USB_GADGET_ACK;
+    hdr[1] = req->ep;
+    hdr[2] = req->tag & 0xff;
+    hdr[3] = req->tag >> 8;
+    cpu_to_le32wu((uint32_t *) (hdr + 4), len);
+    cpu_to_le32wu((uint32_t *) (hdr + 8), ret);
+    usb_gadget_put(s, hdr, sizeof(hdr));
+    usb_gadget_put(s, req->data, len);
+
+    /* Everything completed in this main loop iteration goes out at once */
+    qemu_bh_schedule(s->flush_bh);
+}
+
+static void usb_gadget_done(USBGadgetState *s, int ep, int ret)
+{
+    USBGadgetReq *req = s->queue[ep];
+
+    DPRINTF("EP%i tag %i done: %i\n", ep, req->tag, ret);
+    usb_gadget_ack(s, req, ret);
+    s->queue[ep] = req->next;
+    s->queued[ep] --;
+    s->busy[ep] = 0;
+    qemu_free(req);
+}
+
+static void usb_gadget_complete(USBPacket *p, void *opaque)
+{
+    USBGadgetReq *req = (USBGadgetReq *) opaque;
+    USBGadgetState *s = req->s;
+    int ep = req->ep;
+
+    usb_gadget_done(s, ep, p->len);
+    usb_gadget_dispatch(s, ep);
+}
+
+/* Hand the tokens queued for EP to the device until one is deferred */
+static void usb_gadget_dispatch(USBGadgetState *s, int ep)
+{
+    USBGadgetReq *req;
+    int ret;
+
+    while ((req = s->queue[ep]) && !s->busy[ep]) {
+        switch (req->type) {
+        case USB_GADGET_SETUP:
+            req->p.pid = USB_TOKEN_SETUP;
+            break;
+        case USB_GADGET_IN:
+            req->p.pid = USB_TOKEN_IN;
+            break;
+        default:
+            req->p.pid = USB_TOKEN_OUT;
+            break;
+        }
+        req->p.devaddr = s->dev->addr;
+        req->p.devep = ep;
+        req->p.data = req->data;
+        req->p.len = req->len;
+        req->p.complete_cb = usb_gadget_complete;
+        req->p.complete_opaque = req;
+
+        s->busy[ep] = 1;
+        ret = s->dev->handle_packet(s->dev, &req->p);
+        if (ret == USB_RET_ASYNC)
+            return;
+        usb_gadget_done(s, ep, ret);
+    }
+}
+
+/* Drop everything in flight and start over with a freshly reset device */
+static void usb_gadget_reset(USBGadgetState *s)
+{
+    USBGadgetReq *req;
+    int ep;
+
+    for (ep = 0; ep < USB_GADGET_EPS; ep ++)
+        while ((req = s->queue[ep])) {
+            if (s->busy[ep] && req->p.cancel_cb)
+                usb_cancel_packet(&req->p);
+            s->busy[ep] = 0;
+            s->queue[ep] = req->next;
+            qemu_free(req);
+        }
+    memset(s->queued, 0, sizeof(s->queued));
+
+    usb_send_msg(s->dev, USB_MSG_ATTACH);
+    usb_send_msg(s->dev, USB_MSG_RESET);
+}
+
+static void usb_gadget_queue(USBGadgetState *s, USBGadgetReq *req)
+{
+    USBGadgetReq **q;
+    int ret;
+
+    /* Tokens for endpoints the device doesn't have never reach it, and
+     * a host that doesn't wait for its ACKs is told to retry later.  */
+    if (req->ep >= s->eps || s->queued[req->ep] >= USB_GADGET_QUEUE) {
+        ret = (req->ep >= s->eps) ? USB_RET_STALL : USB_RET_NAK;
+        DPRINTF("EP%i tag %i rejected: %i\n", req->ep, req->tag, ret);
+        usb_gadget_ack(s, req, ret);
+        qemu_free(req);
+        return;
+    }
+
+    s->queued[req->ep] ++;
+    q = &s->queue[req->ep];
+    while (*q)
+        q = &(*q)->next;
+    *q = req;
+    usb_gadget_dispatch(s, req->ep);
+}
+
+static void usb_gadget_header(USBGadgetState *s)
+{
+    USBGadgetReq *req;
+    int type = s->hdr[0];
+    int ep = s->hdr[1];
+    int len = le32_to_cpupu((uint32_t *) (s->hdr + 4));
+
+    if (type == USB_GADGET_RESET) {
+        usb_gadget_reset(s);
+        return;
+    }
+    if ((type != USB_GADGET_SETUP && type != USB_GADGET_IN &&
+                            type != USB_GADGET_OUT) ||
+                    len < 0 || len > USB_GADGET_MAX_LEN) {
+        fprintf(stderr, "%s: bad message %i, length %i\n",
+                        __FUNCTION__, type, len);
+        return;
+    }
+
+    req = qemu_mallocz(sizeof(*req) + len);
+    req->s = s;
+    req->type = type;
+    req->ep = ep;
+    req->tag = s->hdr[2] | (s->hdr[3] << 8);
+    req->len = len;
+
+    if (type == USB_GADGET_IN || !len)
+        usb_gadget_queue(s, req);
+    else {
+        s->rx = req;
+        s->rx_len = 0;
+    }
+}
+
+static int usb_gadget_can_read(void *opaque)
+{
+    USBGadgetState *s = (USBGadgetState *) opaque;
+
+    if (s->rx)
+        return s->rx->len - s->rx_len;
+    return USB_GADGET_HDR - s->hdr_len;
+}
+
+static void usb_gadget_read(void *opaque, const uint8_t *buf, int size)
+{
+    USBGadgetState *s = (USBGadgetState *) opaque;
+    int chunk;
+
+    while (size) {
+        if (s->rx) {
+            chunk = MIN(size, s->rx->len - s->rx_len);
+            memcpy(s->rx->data + s->rx_len, buf, chunk);
+            s->rx_len += chunk;
+            if (s->rx_len == s->rx->len) {
+                USBGadgetReq *req = s->rx;
+                s->rx = 0;
+                usb_gadget_queue(s, req);
+            }
+        } else {
+            chunk = MIN(size, USB_GADGET_HDR - s->hdr_len);
+            memcpy(s->hdr + s->hdr_len, buf, chunk);
+            s->hdr_len += chunk;
+            if (s->hdr_len == USB_GADGET_HDR) {
+                s->hdr_len = 0;
+                usb_gadget_header(s);
+            }
+        }
+        buf += chunk;
+        size -= chunk;
+    }
+}
+
+static void usb_gadget_event(void *opaque, int event)
+{
+    USBGadgetState *s = (USBGadgetState *) opaque;
+
+    if (event == CHR_EVENT_RESET) {
+        if (s->rx)
+            qemu_free(s->rx);
+        s->rx = 0;
+        s->hdr_len = 0;
+        s->tx_len = 0;
+        usb_gadget_reset(s);
+    }
+}
+
+/* Connects DEV, the device side of a USB controller with EPS endpoints,
+ * to the host program on the other end of the -usbgadget character
+ * device, if there is one.  */
+int qemu_register_usb_gadget(USBDevice *dev, int eps)
+{
+    USBGadgetState *s;
+
+    if (!usb_gadget_hd)
+        return -1;
+
+    s = qemu_mallocz(sizeof(USBGadgetState));
+    s->dev = dev;
+    s->eps = MIN(eps, USB_GADGET_EPS);
+    s->chr = usb_gadget_hd;
+    s->flush_bh = qemu_bh_new(usb_gadget_flush, s);
+    usb_gadget_hd = 0;
+
+    qemu_chr_add_handlers(s->chr, usb_gadget_can_read, usb_gadget_read,
+                    usb_gadget_event, s);
+    return 0;
+}
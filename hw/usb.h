@@ -238,6 +238,9 @@ int usb_generic_handle_packet(USBDevice *s, USBPacket *p);
 int set_usb_string(uint8_t *buf, const char *str);
 void usb_send_msg(USBDevice *dev, int msg);
 
+/* usb-gadget.c */
+int qemu_register_usb_gadget(USBDevice *dev, int eps);
+
 /* usb hub */
 USBDevice *usb_hub_init(int nb_ports);
 
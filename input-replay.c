@@ -0,0 +1,267 @@
+/*
+ * Timed input event replay and recording.
+ *
+ * Keyboard, mouse (or touchscreen) and board GPIO events are read from
+ * a trace and injected at the vm_clock time they carry, so a replay is
+ * deterministic under -icount.  Live keyboard and mouse input, from the
+ * SDL or VNC front-ends or the monitor, can be recorded in the same
+ * format.
+ *
+ * This code is licenced under the GPL.
+ */
+
+/*
+ * A binary trace starts with the 4 byte magic "QIRT" and a big-endian
+ * uint32_t version (1), followed by 16 byte records, big-endian:
+ *
+ *   int64_t  time      vm_clock, in ns
+ *   uint8_t  type      INPUT_EV_*
+ *   uint8_t  buttons   MOUSE only: buttons_state
+ *   int16_t  a         KEY: keycode, MOUSE: x, GPIO: line
+ *   int16_t  b         MOUSE: y, GPIO: level
+ *   int16_t  c         MOUSE: z
+ *
+ * Any other file is read as text, one event per line, '#' starts a
+ * comment and numbers may be given in C notation:
+ *
+ *   <time> key <keycode>
+ *   <time> mouse <x> <y> <z> <buttons>
+ *   <time> gpio <line> <level>
+ *
+ * Events must be in time order.  Keycodes are PC scancodes as passed to
+ * kbd_put_keycode(), mouse events go to the current mouse handler and
+ * GPIO lines are numbered by the board that registered the handler.
+ */
+
+#include "qemu-common.h"
+#include "qemu-timer.h"
+#include "console.h"
+
+#define INPUT_EV_KEY	0
+#define INPUT_EV_MOUSE	1
+#define INPUT_EV_GPIO	2
+
+#define INPUT_MAGIC	"QIRT"
+#define INPUT_VERSION	1
+#define INPUT_REC_LEN	16
+
+typedef struct InputEvent {
+    int64_t time;
+    int type;
+    int buttons;
+    int a;
+    int b;
+    int c;
+} InputEvent;
+
+static struct {
+    InputEvent *ev;
+    int len;
+    int next;
+    QEMUTimer *timer;
+
+    QEMUInputGPIOEvent *gpio;
+    void *gpio_opaque;
+
+    FILE *record;
+    int text;
+} input;
+
+void qemu_add_gpio_event_handler(QEMUInputGPIOEvent *func, void *opaque)
+{
+    input.gpio = func;
+    input.gpio_opaque = opaque;
+}
+
+static void input_dispatch(InputEvent *ev)
+{
+    switch (ev->type) {
+    case INPUT_EV_KEY:
+        kbd_put_keycode(ev->a);
+        break;
+    case INPUT_EV_MOUSE:
+        kbd_mouse_event(ev->a, ev->b, ev->c, ev->buttons);
+        break;
+    case INPUT_EV_GPIO:
+        if (input.gpio)
+            input.gpio(input.gpio_opaque, ev->a, ev->b);
+        break;
+    }
+}
+
+/* Injects everything that is due and sleeps until the next event */
+static void input_replay_tick(void *opaque)
+{
+    int64_t now = qemu_get_clock(vm_clock);
+
+    while (input.next < input.len && input.ev[input.next].time <= now)
+        input_dispatch(&input.ev[input.next ++]);
+
+    if (input.next < input.len)
+        qemu_mod_timer(input.timer, input.ev[input.next].time);
+}
+
+static InputEvent *input_add(void)
+{
+    if (!(input.len & 255))
+        input.ev = qemu_realloc(input.ev,
+                        (input.len + 256) * sizeof(InputEvent));
+    memset(&input.ev[input.len], 0, sizeof(InputEvent));
+    return &input.ev[input.len ++];
+}
+
+static int input_load_binary(FILE *f, const char *filename)
+{
+    uint8_t rec[INPUT_REC_LEN];
+    InputEvent *ev;
+    int i;
+
+    if (fread(rec, 1, 4, f) != 4 ||
+                    ((rec[0] << 24) | (rec[1] << 16) |
+                     (rec[2] << 8) | rec[3]) != INPUT_VERSION) {
+        fprintf(stderr, "%s: unsupported trace version\n", filename);
+        return -1;
+    }
+
+    while (fread(rec, 1, INPUT_REC_LEN, f) == INPUT_REC_LEN) {
+        ev = input_add();
+        for (i = 0; i < 8; i ++)
+            ev->time = (ev->time << 8) | rec[i];
+        ev->type = rec[8];
+        ev->buttons = rec[9];
+        ev->a = (int16_t) ((rec[10] << 8) | rec[11]);
+        ev->b = (int16_t) ((rec[12] << 8) | rec[13]);
+        ev->c = (int16_t) ((rec[14] << 8) | rec[15]);
+        /* Keycodes are unsigned */
+        if (ev->type == INPUT_EV_KEY)
+            ev->a &= 0xff;
+    }
+    return 0;
+}
+
+static int input_load_text(FILE *f, const char *filename)
+{
+    char line[256], type[16], *p;
+    long long time;
+    int n, lineno = 0, a, b, c, buttons;
+    InputEvent *ev;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno ++;
+        if ((p = strchr(line, '#')))
+            *p = 0;
+        if (sscanf(line, " %15s", type) != 1)
+            continue;
+
+        a = b = c = buttons = 0;
+        n = sscanf(line, "%lli %15s %i %i %i %i",
+                        &time, type, &a, &b, &c, &buttons);
+        ev = input_add();
+        ev->time = time;
+        if (n == 3 && !strcmp(type, "key"))
+            ev->type = INPUT_EV_KEY;
+        else if (n == 6 && !strcmp(type, "mouse"))
+            ev->type = INPUT_EV_MOUSE;
+        else if (n == 4 && !strcmp(type, "gpio"))
+            ev->type = INPUT_EV_GPIO;
+        else {
+            fprintf(stderr, "%s:%i: bad event\n", filename, lineno);
+            return -1;
+        }
+        ev->a = a;
+        ev->b = b;
+        ev->c = c;
+        ev->buttons = buttons;
+    }
+    return 0;
+}
+
+int input_replay_open(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    char magic[4];
+    int ret, i;
+
+    if (!f)
+        return -1;
+
+    if (fread(magic, 1, 4, f) == 4 && !memcmp(magic, INPUT_MAGIC, 4))
+        ret = input_load_binary(f, filename);
+    else {
+        rewind(f);
+        ret = input_load_text(f, filename);
+    }
+    fclose(f);
+    if (ret)
+        return ret;
+
+    for (i = 1; i < input.len; i ++)
+        if (input.ev[i].time < input.ev[i - 1].time) {
+            fprintf(stderr, "%s: event %i is out of order\n", filename, i);
+            return -1;
+        }
+
+    input.timer = qemu_new_timer(vm_clock, input_replay_tick, NULL);
+    if (input.len)
+        qemu_mod_timer(input.timer, input.ev[0].time);
+    return 0;
+}
+
+/* A "text:" prefix selects the text format, binary is the default */
+int input_record_open(const char *filename)
+{
+    uint8_t hdr[8] = INPUT_MAGIC;
+
+    if (strstart(filename, "text:", &filename))
+        input.text = 1;
+
+    input.record = fopen(filename, input.text ? "w" : "wb");
+    if (!input.record)
+        return -1;
+
+    if (!input.text) {
+        hdr[7] = INPUT_VERSION;
+        fwrite(hdr, 1, sizeof(hdr), input.record);
+    }
+    return 0;
+}
+
+static void input_record(int type, int buttons, int a, int b, int c)
+{
+    int64_t now = qemu_get_clock(vm_clock);
+    uint8_t rec[INPUT_REC_LEN];
+    int i;
+
+    if (input.text) {
+        if (type == INPUT_EV_KEY)
+            fprintf(input.record, "%" PRId64 " key 0x%02x\n", now, a);
+        else
+            fprintf(input.record, "%" PRId64 " mouse %i %i %i %i\n",
+                            now, a, b, c, buttons);
+        return;
+    }
+
+    for (i = 0; i < 8; i ++)
+        rec[i] = now >> (56 - i * 8);
+    rec[8] = type;
+    rec[9] = buttons;
+    rec[10] = a >> 8;
+    rec[11] = a;
+    rec[12] = b >> 8;
+    rec[13] = b;
+    rec[14] = c >> 8;
+    rec[15] = c;
+    fwrite(rec, 1, INPUT_REC_LEN, input.record);
+}
+
+void input_record_key(int keycode)
+{
+    if (input.record)
+        input_record(INPUT_EV_KEY, 0, keycode, 0, 0);
+}
+
+void input_record_mouse(int dx, int dy, int dz, int buttons_state)
+{
+    if (input.record)
+        input_record(INPUT_EV_MOUSE, buttons_state, dx, dy, dz);
+}
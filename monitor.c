@@ -1212,6 +1212,25 @@ static void do_boot_set(Monitor *mon, const char *bootdevice)
     }
 }
 
+/* rtc_warp handler */
+static QEMURTCWarpHandler *qemu_rtc_warp_handler = NULL;
+static void *rtc_warp_opaque;
+
+void qemu_register_rtc_warp(QEMURTCWarpHandler *func, void *opaque)
+{
+    qemu_rtc_warp_handler = func;
+    rtc_warp_opaque = opaque;
+}
+
+static void do_rtc_warp(Monitor *mon, int seconds)
+{
+    if (qemu_rtc_warp_handler)
+        qemu_rtc_warp_handler(rtc_warp_opaque, seconds);
+    else
+        monitor_printf(mon, "no real-time clock on this machine can be "
+                       "warped\n");
+}
+
 static void do_system_reset(Monitor *mon)
 {
     qemu_system_reset_request();
@@ -1734,6 +1753,8 @@ static const mon_cmd_t mon_cmds[] = {
       "addr size file", "save to disk physical memory dump starting at 'addr' of size 'size'", },
     { "boot_set", "s", do_boot_set,
       "bootdevice", "define new values for the boot device list" },
+    { "rtc_warp", "i", do_rtc_warp,
+      "seconds", "move the guest real-time clock by 'seconds'" },
 #if defined(TARGET_I386)
     { "nmi", "i", do_inject_nmi,
       "cpu", "inject an NMI on the given CPU", },
@@ -393,14 +393,18 @@ int qemu_can_send_packet(VLANClientState *vc1)
 {
     VLANState *vlan = vc1->vlan;
     VLANClientState *vc;
+    int busy = 0;
 
     for(vc = vlan->first_client; vc != NULL; vc = vc->next) {
-        if (vc != vc1) {
-            if (vc->fd_can_read && vc->fd_can_read(vc->opaque))
+        if (vc != vc1 && !vc->link_down) {
+            /* Clients without a can_read hook never push back */
+            if (!vc->fd_can_read || vc->fd_can_read(vc->opaque))
                 return 1;
+            busy = 1;
         }
     }
-    return 0;
+    /* With nobody to receive it, a packet is dropped rather than held */
+    return !busy;
 }
 
 static void
@@ -446,21 +450,31 @@ void qemu_send_packet(VLANClientState *vc, const uint8_t *buf, int size)
     }
 }
 
-static ssize_t vc_sendv_compat(VLANClientState *vc, const struct iovec *iov,
-                               int iovcnt)
+/* Copies the packet in IOV to BUFFER, truncated to SIZE bytes */
+static size_t iov_flatten(uint8_t *buffer, size_t size,
+                          const struct iovec *iov, int iovcnt)
 {
-    uint8_t buffer[4096];
     size_t offset = 0;
     int i;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len;
 
-        len = MIN(sizeof(buffer) - offset, iov[i].iov_len);
+        len = MIN(size - offset, iov[i].iov_len);
         memcpy(buffer + offset, iov[i].iov_base, len);
         offset += len;
     }
 
+    return offset;
+}
+
+static ssize_t vc_sendv_compat(VLANClientState *vc, const struct iovec *iov,
+                               int iovcnt)
+{
+    uint8_t buffer[4096];
+    size_t offset;
+
+    offset = iov_flatten(buffer, sizeof(buffer), iov, iovcnt);
     vc->fd_read(vc->opaque, buffer, offset);
 
     return offset;
@@ -481,11 +495,24 @@ ssize_t qemu_sendv_packet(VLANClientState *vc1, const struct iovec *iov,
 {
     VLANState *vlan = vc1->vlan;
     VLANClientState *vc;
+    VLANPacket *packet;
     ssize_t max_len = 0;
 
     if (vc1->link_down)
         return calc_iov_length(iov, iovcnt);
 
+    /* Sent from inside a delivery, queue a flat copy like
+       qemu_send_packet does */
+    if (vlan->delivering) {
+        uint8_t buffer[4096];
+        size_t offset;
+
+        offset = iov_flatten(buffer, sizeof(buffer), iov, iovcnt);
+        qemu_send_packet(vc1, buffer, offset);
+        return offset;
+    }
+
+    vlan->delivering = 1;
     for (vc = vlan->first_client; vc != NULL; vc = vc->next) {
         ssize_t len = 0;
 
@@ -501,6 +528,12 @@ ssize_t qemu_sendv_packet(VLANClientState *vc1, const struct iovec *iov,
 
         max_len = MAX(max_len, len);
     }
+    while ((packet = vlan->send_queue) != NULL) {
+        qemu_deliver_packet(packet->sender, packet->data, packet->size);
+        vlan->send_queue = packet->next;
+        qemu_free(packet);
+    }
+    vlan->delivering = 0;
 
     return max_len;
 }
@@ -1785,7 +1818,7 @@ int net_client_init(const char *device, const char *p)
     }
     if (!strcmp(device, "nic")) {
         static const char * const nic_params[] = {
-            "vlan", "name", "macaddr", "model", NULL
+            "vlan", "name", "macaddr", "model", "coalesce", NULL
         };
         NICInfo *nd;
         uint8_t *macaddr;
@@ -1820,6 +1853,10 @@ int net_client_init(const char *device, const char *p)
         if (get_param_value(buf, sizeof(buf), "model", p)) {
             nd->model = strdup(buf);
         }
+        nd->coalesce = 0;
+        if (get_param_value(buf, sizeof(buf), "coalesce", p)) {
+            nd->coalesce = strtol(buf, NULL, 0);
+        }
         nd->vlan = vlan;
         nd->name = name;
         nd->used = 1;
@@ -81,6 +81,7 @@ struct NICInfo {
     VLANState *vlan;
     void *private;
     int used;
+    int coalesce;	/* Interrupt coalescing window in us, 0 if off */
 };
 
 extern int nb_nics;
@@ -361,6 +361,40 @@ Network adapter that supports CDC ethernet and RNDIS protocols.
 @end table
 ETEXI
 
+DEF("usbgadget", HAS_ARG, QEMU_OPTION_usbgadget,
+    "-usbgadget dev  drive the board's USB device controller from 'dev'\n")
+STEXI
+@item -usbgadget @var{dev}
+Let a program connected to character device @var{dev} act as the USB
+host of the emulated USB device controller, e.g.
+@code{-usbgadget unix:/tmp/gadget,server,nowait}.  Setup, IN and OUT
+tokens and their completions are exchanged as framed messages, described
+in @file{hw/usb-gadget.c}.
+ETEXI
+
+DEF("input-replay", HAS_ARG, QEMU_OPTION_input_replay,
+    "-input-replay file\n"
+    "                inject the timed input events from 'file'\n")
+STEXI
+@item -input-replay @var{file}
+Inject the keyboard, mouse or touchscreen and board GPIO events of the
+trace @var{file}, each at the virtual clock time it carries.  Combined
+with @option{-icount} the guest sees the same input at the same point
+of execution on every run.  Traces are either binary or text, both
+formats are described in @file{input-replay.c}.
+ETEXI
+
+DEF("input-record", HAS_ARG, QEMU_OPTION_input_record,
+    "-input-record [text:]file\n"
+    "                record keyboard and mouse input to 'file'\n")
+STEXI
+@item -input-record [text:]@var{file}
+Record keyboard and mouse input, from the SDL or VNC display or the
+monitor, to @var{file} with its virtual clock time, in the format read
+by @option{-input-replay}.  The trace is binary unless the file name is
+prefixed with @code{text:}.
+ETEXI
+
 DEF("name", HAS_ARG, QEMU_OPTION_name,
     "-name string    set the name of the guest\n")
 STEXI
@@ -724,8 +758,9 @@ STEXI
 ETEXI
 
 DEF("net", HAS_ARG, QEMU_OPTION_net, \
-    "-net nic[,vlan=n][,macaddr=addr][,model=type][,name=str]\n"
+    "-net nic[,vlan=n][,macaddr=addr][,model=type][,name=str][,coalesce=us]\n"
     "                create a new Network Interface Card and connect it to VLAN 'n'\n"
+    "                (coalesce: one RX/TX interrupt per 'us' microseconds window)\n"
 #ifdef CONFIG_SLIRP
     "-net user[,vlan=n][,name=str][,hostname=host]\n"
     "                connect the user mode network stack to VLAN 'n' and send\n"
@@ -758,7 +793,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net, \
     "-net none       use it alone to have zero network devices; if no -net option\n"
     "                is provided, the default is '-net nic -net user'\n")
 STEXI
-@item -net nic[,vlan=@var{n}][,macaddr=@var{addr}][,model=@var{type}][,name=@var{name}]
+@item -net nic[,vlan=@var{n}][,macaddr=@var{addr}][,model=@var{type}][,name=@var{name}][,coalesce=@var{us}]
 Create a new Network Interface Card and connect it to VLAN @var{n} (@var{n}
 = 0 is the default). The NIC is an ne2k_pci by default on the PC
 target. Optionally, the MAC address can be changed to @var{addr}
@@ -771,6 +806,9 @@ Valid values for @var{type} are
 @code{e1000}, @code{smc91c111}, @code{lance} and @code{mcf_fec}.
 Not all devices are supported on all targets.  Use -net nic,model=?
 for a list of available devices for your target.
+@option{coalesce}=@var{us} makes models that support it (@code{dm9000})
+raise at most one receive/transmit interrupt per @var{us} microseconds and
+deliver the frames that arrive in between as one batch.
 
 @item -net user[,vlan=@var{n}][,hostname=@var{name}][,name=@var{name}]
 Use the user mode network stack which requires no administrator
@@ -0,0 +1,70 @@
+/* Check the SIMD S3C24xx LCD line converters against the C ones */
+#include "../hw/s3c24xx_lcd.c"
+
+#ifdef S3C_LCD_SIMD
+#define MAX_WIDTH	800
+#define GUARD		64	/* Pixels around the line, must stay intact */
+
+static uint8_t src[MAX_WIDTH * 4 + 32];
+static uint32_t ref[MAX_WIDTH + 2 * GUARD];
+static uint32_t out[MAX_WIDTH + 2 * GUARD];
+
+static int check(const char *name, drawfn c_fn, drawfn simd_fn)
+{
+    int width, deststep, first;
+    uint8_t *rdest, *odest;
+
+    for (width = 1; width <= MAX_WIDTH; width ++)
+        for (deststep = 4; deststep >= -4; deststep -= 8) {
+            memset(ref, 0x5a, sizeof(ref));
+            memset(out, 0x5a, sizeof(out));
+            /* A negative step writes the line backwards from its end */
+            first = GUARD + (deststep < 0 ? width - 1 : 0);
+            rdest = (uint8_t *) &ref[first];
+            odest = (uint8_t *) &out[first];
+
+            c_fn(NULL, rdest, src, width, deststep);
+            simd_fn(NULL, odest, src, width, deststep);
+            if (memcmp(ref, out, sizeof(ref))) {
+                fprintf(stderr, "%s: mismatch at width %i, deststep %i\n",
+                                name, width, deststep);
+                return 1;
+            }
+        }
+    return 0;
+}
+
+int main(void)
+{
+    int i, ret = 0;
+
+    srand(1);
+    for (i = 0; i < sizeof(src); i ++)
+        src[i] = rand();
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        ret |= check("16bpp sse2",
+                        s3c_draw_line16a_32, s3c_draw_line16a_32_sse2);
+        ret |= check("24bpp sse2",
+                        s3c_draw_line24_32, s3c_draw_line24_32_sse2);
+    } else
+        printf("SSE2 not supported, skipped\n");
+
+    if (__builtin_cpu_supports("avx2")) {
+        ret |= check("16bpp avx2",
+                        s3c_draw_line16a_32, s3c_draw_line16a_32_avx2);
+        ret |= check("24bpp avx2",
+                        s3c_draw_line24_32, s3c_draw_line24_32_avx2);
+    } else
+        printf("AVX2 not supported, skipped\n");
+
+    return ret;
+}
+#else
+int main(void)
+{
+    printf("No SIMD LCD converters on this host, skipped\n");
+    return 0;
+}
+#endif
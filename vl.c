@@ -234,6 +234,7 @@ int no_quit = 0;
 CharDriverState *serial_hds[MAX_SERIAL_PORTS];
 CharDriverState *parallel_hds[MAX_PARALLEL_PORTS];
 CharDriverState *virtcon_hds[MAX_VIRTIO_CONSOLES];
+CharDriverState *usb_gadget_hd;
 #ifdef TARGET_I386
 int win2k_install_hack = 0;
 int rtc_td_hack = 0;
@@ -630,6 +631,7 @@ void qemu_remove_mouse_event_handler(QEMUPutMouseEntry *entry)
 
 void kbd_put_keycode(int keycode)
 {
+    input_record_key(keycode);
     if (qemu_put_kbd_event) {
         qemu_put_kbd_event(qemu_put_kbd_event_opaque, keycode);
     }
@@ -641,6 +643,7 @@ void kbd_mouse_event(int dx, int dy, int dz, int buttons_state)
     void *mouse_event_opaque;
     int width;
 
+    input_record_mouse(dx, dy, dz, buttons_state);
     if (!qemu_put_mouse_event_current) {
         return;
     }
@@ -4824,6 +4827,9 @@ int main(int argc, char **argv, char **envp)
     const char *cpu_model;
     const char *usb_devices[MAX_USB_CMDLINE];
     int usb_devices_index;
+    const char *usb_gadget_device = NULL;
+    const char *input_replay_file = NULL;
+    const char *input_record_file = NULL;
 #ifndef _WIN32
     int fds[2];
 #endif
@@ -5407,6 +5413,15 @@ int main(int argc, char **argv, char **envp)
                 usb_devices[usb_devices_index] = optarg;
                 usb_devices_index++;
                 break;
+            case QEMU_OPTION_usbgadget:
+                usb_gadget_device = optarg;
+                break;
+            case QEMU_OPTION_input_replay:
+                input_replay_file = optarg;
+                break;
+            case QEMU_OPTION_input_record:
+                input_record_file = optarg;
+                break;
             case QEMU_OPTION_smp:
                 smp_cpus = atoi(optarg);
                 if (smp_cpus < 1) {
@@ -5898,11 +5913,31 @@ int main(int argc, char **argv, char **envp)
         }
     }
 
+    if (usb_gadget_device) {
+        usb_gadget_hd = qemu_chr_open("usbgadget", usb_gadget_device, NULL);
+        if (!usb_gadget_hd) {
+            fprintf(stderr, "qemu: could not open USB gadget device '%s'\n",
+                    usb_gadget_device);
+            exit(1);
+        }
+    }
+
     module_call_init(MODULE_INIT_DEVICE);
 
     machine->init(ram_size, boot_devices,
                   kernel_filename, kernel_cmdline, initrd_filename, cpu_model);
 
+    /* After the machine, so that the input handlers are in place */
+    if (input_replay_file && input_replay_open(input_replay_file) < 0) {
+        fprintf(stderr, "qemu: could not replay input from '%s'\n",
+                input_replay_file);
+        exit(1);
+    }
+    if (input_record_file && input_record_open(input_record_file) < 0) {
+        fprintf(stderr, "qemu: could not record input to '%s'\n",
+                input_record_file);
+        exit(1);
+    }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         for (i = 0; i < nb_numa_nodes; i++) {